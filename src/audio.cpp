@@ -0,0 +1,245 @@
+#include <iostream>
+#include <memory>
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+#include "chip8.h"
+#include "audio.h"
+
+
+const int TONE_FREQUENCY = 440;     // buzzer pitch in Hz
+const int16_t TONE_VOLUME = 6000;
+
+// band-limited step table: BLEP_PHASES sub-sample positions of a BLEP_TAPS sample kernel
+const int BLEP_PHASES = 64;
+const int BLEP_TAPS = audio_output::BLEP_TAPS;
+const int BLEP_HALF = BLEP_TAPS / 2;
+
+static const std::array<std::array<float, BLEP_TAPS>, BLEP_PHASES>& blep_table() {
+    /*
+     * Entry [phase][tap] is how much of a unit step at phase/BLEP_PHASES of a sample after sample
+     * BLEP_HALF - 1 arrives during sample tap, for a step band-limited by a Blackman-windowed sinc
+     * Each row sums to exactly 1, so the synthesized level never drifts
+     */
+
+    static std::array<std::array<float, BLEP_TAPS>, BLEP_PHASES> table = [] {
+        const double CUTOFF = 0.9;      // of the Nyquist frequency
+        const int STEPS = 32;           // integration steps per sample
+
+        auto impulse = [&](double t) {
+            if (t <= -BLEP_HALF || t >= BLEP_HALF) {
+                return 0.0;
+            }
+            double x = M_PI * CUTOFF * t;
+            double sinc = t == 0 ? 1.0 : std::sin(x) / x;
+            double w = 2 * M_PI * (t + BLEP_HALF) / BLEP_TAPS;
+            return CUTOFF * sinc * (0.42 - 0.5 * std::cos(w) + 0.08 * std::cos(2 * w));
+        };
+
+        std::array<std::array<float, BLEP_TAPS>, BLEP_PHASES> rows;
+        for (int phase = 0; phase < BLEP_PHASES; ++phase) {
+            double offset = (double) phase / BLEP_PHASES;
+            std::array<double, BLEP_TAPS> row;
+            double total = 0;
+            for (int tap = 0; tap < BLEP_TAPS; ++tap) {
+                // integrate the impulse over the sample, midpoint rule
+                double start = tap - BLEP_HALF - offset;
+                double sum = 0;
+                for (int step = 0; step < STEPS; ++step) {
+                    sum += impulse(start + (step + 0.5) / STEPS);
+                }
+                row[tap] = sum / STEPS;
+                total += row[tap];
+            }
+            for (int tap = 0; tap < BLEP_TAPS; ++tap) {
+                rows[phase][tap] = row[tap] / total;
+            }
+        }
+        return rows;
+    }();
+    return table;
+}
+
+audio_output::audio_output(int rate, int buffer_samples, bool clocked) {
+    SDL_AudioSpec wanted = {};
+    wanted.freq = rate;
+    wanted.format = AUDIO_S16SYS;
+    wanted.channels = 1;
+    wanted.samples = buffer_samples;
+    wanted.callback = callback;
+    wanted.userdata = this;
+
+    SDL_AudioSpec obtained = {};
+    device = SDL_OpenAudioDevice(NULL, 0, &wanted, &obtained, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    if (device == 0) {
+        std::cerr << "Cannot open audio device: " << SDL_GetError() << std::endl;
+        return;
+    }
+
+    this->rate = obtained.freq;
+    this->buffer_samples = obtained.samples;
+    clocked_mode = clocked;
+    phase_step = (uint32_t) (((uint64_t) TONE_FREQUENCY << 32) / this->rate);
+    blep_table();   // build it now rather than in the first callback
+    SDL_PauseAudioDevice(device, 0);
+}
+
+audio_output::~audio_output() {
+    if (device != 0) {
+        SDL_CloseAudioDevice(device);
+    }
+}
+
+bool audio_output::is_open() const {
+    return device != 0;
+}
+
+void audio_output::set_tone(bool on) {
+    tone.store(on, std::memory_order_relaxed);
+}
+
+void audio_output::play_digitized(const chip8& game) {
+    /*
+     * Copies the sample out of game memory so the audio thread never reads the machine,
+     * then swaps it in under the device lock
+     * Samples are 8-bit unsigned mono at the ROM's rate
+     */
+
+    std::vector<int16_t> sample;
+    const chip8::digitized_sound& sound = game.mega_sound;
+    if (sound.playing && sound.rate != 0 && sound.length != 0) {
+        sample.resize(sound.length);
+        for (unsigned int index = 0; index < sound.length; ++index) {
+            sample[index] = (game.read_memory(sound.address + index) - 0x80) << 8;
+        }
+    }
+
+    if (device == 0) {
+        return;
+    }
+    SDL_LockAudioDevice(device);
+    digitized.swap(sample);
+    digitized_position = 0;
+    digitized_step = rate != 0 ? ((uint64_t) sound.rate << 32) / rate : 0;
+    digitized_loop = sound.loop;
+    SDL_UnlockAudioDevice(device);
+}
+
+bool audio_output::clocked() const {
+    return clocked_mode;
+}
+
+int audio_output::frames_wanted() const {
+    /*
+     * Keeps one device buffer plus two frames of samples queued
+     */
+
+    int frame = rate / 60;
+    int target = buffer_samples + 2 * frame;
+    int queued = ring.size();
+    if (queued >= target) {
+        return 0;
+    }
+    return (target - queued + frame - 1) / frame;
+}
+
+void audio_output::end_frame() {
+    int samples = (rate + sample_remainder) / 60;
+    sample_remainder = (rate + sample_remainder) % 60;
+
+    frame_samples.resize(samples);
+    fill(frame_samples.data(), samples);
+    for (int16_t sample : frame_samples) {
+        if (!ring.try_push(sample)) {
+            break;
+        }
+    }
+}
+
+unsigned long long audio_output::underruns() const {
+    return underrun_count.load(std::memory_order_relaxed);
+}
+
+void audio_output::callback(void* userdata, Uint8* stream, int length) {
+    audio_output* audio = (audio_output*) userdata;
+    int16_t* out = (int16_t*) stream;
+    int samples = length / sizeof(int16_t);
+
+    if (!audio->clocked_mode) {
+        audio->fill(out, samples);
+        return;
+    }
+
+    // clocked mode, play what the emulation thread queued and pad with silence if it fell behind
+    int index = 0;
+    while (index < samples && audio->ring.try_pop(out[index])) {
+        ++index;
+    }
+    if (index < samples) {
+        std::fill(out + index, out + samples, 0);
+        audio->underrun_count.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void audio_output::add_step(double delta, int phase) {
+    const std::array<float, BLEP_TAPS>& kernel = blep_table()[phase];
+    for (int tap = 0; tap < BLEP_TAPS; ++tap) {
+        steps[(step_position + tap) % steps.size()] += delta * kernel[tap];
+    }
+}
+
+void audio_output::fill(int16_t* out, int samples) {
+    /*
+     * Mixes the buzzer square wave and the digitized sample into out
+     * Every edge of the square wave is added as a band-limited step at its exact sub-sample position,
+     * so the buzzer does not alias at low sample rates; the cost is a table row per edge,
+     * and the output lags by BLEP_HALF samples
+     */
+
+    int target = tone.load(std::memory_order_relaxed) ? TONE_VOLUME : 0;
+    for (int index = 0; index < samples; ++index) {
+        if (gain != target) {   // buzzer turned on or off since the last sample
+            add_step((double) (target - gain) * wave, 0);
+            gain = target;
+        }
+
+        uint32_t previous = phase;
+        phase += phase_step;
+        uint32_t edge = phase >= 0x80000000u ? 0x80000000u : 0;     // last edge the phase passed
+        if ((previous < 0x80000000u) != (phase < 0x80000000u)) {
+            // the edge fell (phase - edge) / phase_step samples before this one
+            int sub_sample = (int) ((uint64_t) (phase_step - (phase - edge)) * BLEP_PHASES / phase_step);
+            add_step(-2.0 * wave * gain, std::min(sub_sample, BLEP_PHASES - 1));
+            wave = -wave;
+        }
+
+        // the oldest pending sample is now complete
+        double& pending = steps[step_position % steps.size()];
+        level += pending;
+        pending = 0;
+        ++step_position;
+        if (gain == 0 && ++quiet_samples > BLEP_TAPS) {    // settled, clear rounding error
+            level = 0;
+        }
+        else if (gain != 0) {
+            quiet_samples = 0;
+        }
+
+        int value = (int) std::lround(level);
+
+        if (!digitized.empty()) {
+            size_t position = digitized_position >> 32;
+            if (position >= digitized.size() && digitized_loop) {
+                digitized_position %= (uint64_t) digitized.size() << 32;
+                position = digitized_position >> 32;
+            }
+            if (position < digitized.size()) {
+                value += digitized[position] / 2;
+                digitized_position += digitized_step;
+            }
+        }
+
+        out[index] = (int16_t) std::clamp(value, -32768, 32767);
+    }
+}
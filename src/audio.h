@@ -0,0 +1,69 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include <SDL2/SDL.h>
+
+#include "spsc_queue.h"
+
+class chip8;
+
+class audio_output {
+    /*
+     * Synthesizes the sound timer buzzer and plays MegaChip digitized sound from an SDL audio callback
+     * The emulation thread only publishes whether the buzzer is on, so nothing is queued per frame
+     *
+     * In clocked mode the emulation thread synthesizes each frame's samples instead, into a ring
+     * that the callback drains; the emulator runs whenever the ring runs low, so the audio device's
+     * clock sets the emulation speed and sound never drifts from the picture
+     */
+
+public:
+    static const int BLEP_TAPS = 16;    // length of the band-limited step, in samples
+
+    audio_output(int rate = 22050, int buffer_samples = 256, bool clocked = false);
+    ~audio_output();
+
+    bool is_open() const;
+    void set_tone(bool on);                     // once per frame, from the emulation thread
+    void play_digitized(const chip8& game);     // when sound_flag is set, starts or stops game.mega_sound
+
+    // clocked mode
+    bool clocked() const;           // false if the device could not be opened
+    int frames_wanted() const;      // frames to emulate now to keep the ring filled
+    void end_frame();               // after each emulated frame, synthesizes its samples into the ring
+    unsigned long long underruns() const;
+
+private:
+    static void callback(void* userdata, Uint8* stream, int length);
+    void fill(int16_t* out, int samples);
+    void add_step(double delta, int phase);
+
+    SDL_AudioDeviceID device = 0;
+    int rate = 0;                   // output samples per second
+    std::atomic<bool> tone{false};
+
+    bool clocked_mode = false;
+    int buffer_samples = 0;                 // samples the device asks for at a time
+    spsc_queue<int16_t, 8192> ring;         // samples waiting for the callback
+    int sample_remainder = 0;               // 60ths of a sample carried over, when rate is not a multiple of 60
+    std::vector<int16_t> frame_samples;     // samples of the last frame
+    std::atomic<unsigned long long> underrun_count{0};
+
+    // synthesizer, owned by the audio thread (the emulation thread in clocked mode), except under SDL_LockAudioDevice
+    uint32_t phase = 0;                 // square wave phase, a full cycle is 2^32
+    uint32_t phase_step = 0;
+    int wave = 1;                       // sign of the square wave, flipped at every edge
+    int gain = 0;                       // buzzer amplitude, 0 while it is off
+    std::array<double, 2 * BLEP_TAPS> steps{};  // band-limited steps still arriving, by sample
+    unsigned int step_position = 0;     // sample being completed
+    double level = 0;                   // sum of all steps so far, the buzzer output
+    int quiet_samples = 0;              // samples since the buzzer went off
+    std::vector<int16_t> digitized;     // MegaChip sample, converted to signed 16-bit
+    uint64_t digitized_position = 0;    // 32.32 fixed point index into digitized
+    uint64_t digitized_step = 0;
+    bool digitized_loop = false;
+};
@@ -0,0 +1,222 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include <cstdio>
+
+#include "chip8.h"
+#include "input_script.h"
+#include "lockstep.h"
+
+
+namespace fs = std::filesystem;
+
+struct options {
+    unsigned long long frames = 600;
+    uint64_t seed = 1;
+    unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+    int lanes = 0;              // run each ROM as this many lockstep copies, 0 for one chip8
+    fs::path roms;              // ROM file or directory of ROMs
+    fs::path input;             // key presses applied to every ROM, optional
+};
+
+struct result {
+    bool loaded = false;
+    unsigned long long cycles = 0;
+    uint64_t frame_hash = 0;            // of the last frame
+    unsigned long long unknown_opcodes = 0;
+    double vectorized = 0;              // fraction of lane cycles run together, with --lanes
+    double seconds = 0;
+};
+
+
+template <int LANES>
+void run_lanes(const options& opts, const chip8& game, input_script& script, result& run) {
+    /*
+     * Runs LANES lockstep copies of game with the same keys, reporting lane 0's hash
+     */
+
+    lockstep<LANES> lanes(game);
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long long frame = 0; frame < opts.frames; ++frame) {
+        unsigned short keys = script.keys_at(frame);
+        for (int lane = 0; lane < LANES; ++lane) {
+            lanes.set_keys(lane, keys);
+        }
+        lanes.emulate_frame();
+    }
+    run.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    run.cycles = opts.frames * CYCLES_PER_FRAME * LANES;
+    run.frame_hash = lanes.machine(0).frame_hash;
+    run.unknown_opcodes = lanes.machine(0).unknown_opcodes;
+    run.vectorized = (double) lanes.vector_cycles / std::max(1ULL, lanes.vector_cycles + lanes.scalar_cycles);
+}
+
+result run_rom(const options& opts, const fs::path& rom) {
+    /*
+     * Plays a ROM for opts.frames frames as fast as possible
+     */
+
+    result run;
+    chip8 game;
+    game.rng_seed = opts.seed;
+    game.report_unknown = false;    // counted instead, printing would serialize the threads
+    game.initialize();
+    if (!game.load_rom(rom.c_str())) {
+        return run;
+    }
+    run.loaded = true;
+
+    input_script script;
+    if (!opts.input.empty()) {
+        script.load(opts.input.c_str());
+    }
+
+    switch (opts.lanes) {
+        case 8: run_lanes<8>(opts, game, script, run); return run;
+        case 16: run_lanes<16>(opts, game, script, run); return run;
+        case 32: run_lanes<32>(opts, game, script, run); return run;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long long frame = 0; frame < opts.frames; ++frame) {
+        script.apply(game, frame);
+        game.emulate_frame();
+    }
+    run.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    run.cycles = opts.frames * CYCLES_PER_FRAME;
+    run.frame_hash = game.frame_hash;
+    run.unknown_opcodes = game.unknown_opcodes;
+    return run;
+}
+
+std::string json_string(const std::string& text) {
+    std::ostringstream out;
+    out << '"';
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        }
+        else if (c < 0x20) {
+            out << "\\u00" << "0123456789abcdef"[c >> 4] << "0123456789abcdef"[c & 0xF];
+        }
+        else {
+            out << c;
+        }
+    }
+    out << '"';
+    return out.str();
+}
+
+int main(int argc, const char* argv[]) {
+    options opts;
+    std::vector<std::string> paths;
+
+    for (int arg = 1; arg < argc; ++arg) {
+        std::string name = argv[arg];
+        if (name == "--frames" && arg + 1 < argc) {
+            opts.frames = std::stoull(argv[++arg]);
+        }
+        else if (name == "--seed" && arg + 1 < argc) {
+            opts.seed = std::stoull(argv[++arg]);
+        }
+        else if (name == "--threads" && arg + 1 < argc) {
+            opts.threads = std::max(1, std::atoi(argv[++arg]));
+        }
+        else if (name == "--lanes" && arg + 1 < argc) {
+            opts.lanes = std::atoi(argv[++arg]);
+            if (opts.lanes != 8 && opts.lanes != 16 && opts.lanes != 32) {
+                std::cout << "--lanes must be 8, 16 or 32" << std::endl;
+                return 2;
+            }
+        }
+        else if (name == "--input" && arg + 1 < argc) {
+            opts.input = argv[++arg];
+        }
+        else {
+            paths.push_back(name);
+        }
+    }
+
+    if (paths.size() != 1) {
+        std::cout << "Usage: ./chip-oct-batch [--frames N] [--seed N] [--threads N] [--lanes 8|16|32] [--input script] rom_or_dir" << std::endl;
+        return 2;
+    }
+    opts.roms = paths[0];
+
+    input_script check;
+    if (!opts.input.empty() && !check.load(opts.input.c_str())) {
+        return 2;
+    }
+
+    std::vector<fs::path> roms;
+    if (fs::is_directory(opts.roms)) {
+        for (const auto& entry : fs::directory_iterator(opts.roms)) {
+            if (entry.is_regular_file()) {
+                roms.push_back(entry.path());
+            }
+        }
+        std::sort(roms.begin(), roms.end());
+    }
+    else {
+        roms.push_back(opts.roms);
+    }
+
+    // each worker takes the next ROM until none are left
+    std::vector<result> results(roms.size());
+    std::atomic<size_t> next{0};
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> workers;
+    unsigned int threads = std::min<size_t>(opts.threads, std::max<size_t>(roms.size(), 1));
+    for (unsigned int thread = 0; thread < threads; ++thread) {
+        workers.emplace_back([&] {
+            for (size_t index = next++; index < roms.size(); index = next++) {
+                results[index] = run_rom(opts, roms[index]);
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // report as JSON on stdout
+    int failed = 0;
+    unsigned long long cycles = 0;
+    std::cout << "{\n  \"frames\": " << opts.frames << ",\n  \"seed\": " << opts.seed
+              << ",\n  \"lanes\": " << std::max(opts.lanes, 1)
+              << ",\n  \"threads\": " << threads << ",\n  \"roms\": [";
+    for (size_t index = 0; index < roms.size(); ++index) {
+        const result& run = results[index];
+        std::cout << (index == 0 ? "\n" : ",\n") << "    {\"rom\": " << json_string(roms[index].filename().string());
+        if (!run.loaded) {
+            std::cout << ", \"error\": \"cannot load\"}";
+            ++failed;
+            continue;
+        }
+
+        char hash[17];
+        std::snprintf(hash, sizeof(hash), "%016llx", (unsigned long long) run.frame_hash);
+        std::cout << ", \"frame_hash\": \"" << hash << "\""
+                  << ", \"unknown_opcodes\": " << run.unknown_opcodes
+                  << ", \"mips\": " << (run.seconds > 0 ? run.cycles / run.seconds / 1e6 : 0);
+        if (opts.lanes != 0) {
+            std::cout << ", \"vectorized\": " << run.vectorized;
+        }
+        std::cout
+                  << ", \"seconds\": " << run.seconds << "}";
+        cycles += run.cycles;
+    }
+    std::cout << "\n  ],\n  \"mips\": " << (seconds > 0 ? cycles / seconds / 1e6 : 0)
+              << ",\n  \"seconds\": " << seconds << "\n}" << std::endl;
+
+    return failed == 0 ? 0 : 1;
+}
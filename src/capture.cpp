@@ -0,0 +1,385 @@
+#include <memory>
+#include <chrono>
+#include <cstring>
+#include <unordered_map>
+#include <algorithm>
+
+#include "chip8.h"
+#include "capture.h"
+#include "hash.h"
+
+
+frame_capture::frame::frame() {
+    // sized up front so the emulation thread never allocates
+    pixels.reserve(64 * 32 / 8);
+    colors.reserve(MEGA_WIDTH * MEGA_HEIGHT);
+}
+
+frame_capture::frame_capture(const char* path) {
+    file = std::fopen(path, "wb");
+    size_t length = std::strlen(path);
+    gif = length >= 4 && std::strcmp(path + length - 4, ".gif") == 0;
+
+    if (file != NULL) {
+        writer = std::thread(&frame_capture::write_frames, this);
+    }
+}
+
+frame_capture::~frame_capture() {
+    if (file == NULL) {
+        return;
+    }
+
+    stopping = true;
+    writer.join();
+
+    // the stream runs to the last tapped frame, even if it repeated the one before
+    if (gif && have_written) {
+        flush_gif_image(std::max(frame_number, written_number + 1));
+        std::fputc(0x3B, file);     // trailer
+    }
+    else if (have_written) {
+        for (unsigned long long gap = written_number + 1; gap < frame_number; ++gap) {
+            std::fwrite("FRAME\n", 1, 6, file);
+            std::fwrite(encoded.data(), 1, encoded.size(), file);
+        }
+    }
+    std::fclose(file);
+}
+
+bool frame_capture::is_open() const {
+    return file != NULL;
+}
+
+unsigned long long frame_capture::dropped() const {
+    return dropped_frames;
+}
+
+void frame_capture::tap(const chip8& game) {
+    /*
+     * Packs the current display and hands it to the writer thread without waiting
+     * Frames that hash the same as the last queued frame are dropped here
+     * If the queue is full the frame is lost rather than stalling emulation
+     */
+
+    unsigned long long number = frame_number++;
+    uint64_t hash = 0;
+
+    if (game.megachip) {
+        staging.megachip = true;
+        staging.width = MEGA_WIDTH;
+        staging.height = MEGA_HEIGHT;
+        staging.colors.assign(game.mega_frame.begin(), game.mega_frame.end());
+        hash = hash64(staging.colors.data(), staging.colors.size() * sizeof(uint32_t), 1);
+    }
+    else {
+        staging.megachip = false;
+        staging.width = 64;
+        staging.height = 32;
+        staging.pixels.assign(64 * 32 / 8, 0);
+        for (int pos = 0; pos < 64 * 32; ++pos) {
+            staging.pixels[pos >> 3] |= (game.display[pos] & 1) << (7 - (pos & 7));
+        }
+        hash = hash64(staging.pixels.data(), staging.pixels.size());
+    }
+
+    if (have_last && hash == last_hash) {   // nothing changed on screen
+        return;
+    }
+
+    frame* slot = queue.producer_slot();
+    if (slot == NULL) {
+        ++dropped_frames;
+        return;
+    }
+
+    last_hash = hash;
+    have_last = true;
+
+    slot->number = number;
+    slot->width = staging.width;
+    slot->height = staging.height;
+    slot->megachip = staging.megachip;
+    std::swap(slot->pixels, staging.pixels);
+    std::swap(slot->colors, staging.colors);
+    if (staging.megachip) {
+        std::copy(game.palette.begin(), game.palette.end(), slot->palette.begin());
+    }
+    queue.push();
+}
+
+void frame_capture::write_frames() {
+    /*
+     * Writer thread: encodes queued frames until capture stops and the queue is drained
+     */
+
+    while (true) {
+        frame* item = queue.consumer_slot();
+        if (item == NULL) {
+            if (stopping) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            continue;
+        }
+
+        unpack(*item);
+        if (gif) {
+            write_gif(*item);
+        }
+        else {
+            write_y4m(*item);
+        }
+        written_number = item->number;
+        have_written = true;
+        queue.pop();
+    }
+}
+
+void frame_capture::unpack(const frame& item) {
+    /*
+     * Expands a frame to ARGB at the stream size
+     * The stream size is set by the first frame, frames of the other mode are stretched to fit
+     */
+
+    if (width == 0) {
+        width = item.width;
+        height = item.height;
+        rgb.resize(width * height);
+    }
+
+    for (int row = 0; row < height; ++row) {
+        int source_row = row * item.height / height;
+        for (int column = 0; column < width; ++column) {
+            int source = source_row * item.width + column * item.width / width;
+            if (item.megachip) {
+                rgb[row * width + column] = item.colors[source];
+            }
+            else {
+                bool on = item.pixels[source >> 3] & (0x80 >> (source & 7));
+                rgb[row * width + column] = on ? 0xFFFFFFFF : 0xFF000000;
+            }
+        }
+    }
+}
+
+void frame_capture::write_y4m(const frame& item) {
+    /*
+     * Writes a frame as YUV 4:2:0
+     * Y4M is constant rate, so frames dropped as duplicates are written again from the last frame
+     */
+
+    if (!have_written) {
+        std::fprintf(file, "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 C420jpeg\n", width, height);
+    }
+    else {
+        for (unsigned long long gap = written_number + 1; gap < item.number; ++gap) {
+            std::fwrite("FRAME\n", 1, 6, file);
+            std::fwrite(encoded.data(), 1, encoded.size(), file);
+        }
+    }
+
+    int luma_size = width * height;
+    int chroma_size = luma_size / 4;
+    encoded.resize(luma_size + chroma_size * 2);
+    unsigned char* y_plane = encoded.data();
+    unsigned char* u_plane = y_plane + luma_size;
+    unsigned char* v_plane = u_plane + chroma_size;
+
+    // BT.601 studio range
+    for (int pos = 0; pos < luma_size; ++pos) {
+        int r = (rgb[pos] >> 16) & 0xFF;
+        int g = (rgb[pos] >> 8) & 0xFF;
+        int b = rgb[pos] & 0xFF;
+        y_plane[pos] = 16 + ((66 * r + 129 * g + 25 * b + 128) >> 8);
+    }
+
+    for (int row = 0; row < height / 2; ++row) {
+        for (int column = 0; column < width / 2; ++column) {
+            int r = 0, g = 0, b = 0;
+            for (int pos : { (row * 2) * width + column * 2, (row * 2) * width + column * 2 + 1,
+                             (row * 2 + 1) * width + column * 2, (row * 2 + 1) * width + column * 2 + 1 }) {
+                r += (rgb[pos] >> 16) & 0xFF;
+                g += (rgb[pos] >> 8) & 0xFF;
+                b += rgb[pos] & 0xFF;
+            }
+            r /= 4;
+            g /= 4;
+            b /= 4;
+            u_plane[row * (width / 2) + column] = 128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8);
+            v_plane[row * (width / 2) + column] = 128 + ((112 * r - 94 * g - 18 * b + 128) >> 8);
+        }
+    }
+
+    std::fwrite("FRAME\n", 1, 6, file);
+    std::fwrite(encoded.data(), 1, encoded.size(), file);
+}
+
+static void put_short(std::vector<unsigned char>& out, int value) {
+    out.push_back(value & 0xFF);
+    out.push_back((value >> 8) & 0xFF);
+}
+
+static void lzw_encode(const std::vector<unsigned char>& indices, int min_code_size, std::vector<unsigned char>& out) {
+    /*
+     * GIF LZW compression of palette indices into 255-byte sub-blocks
+     * The dictionary is an open-addressed table of (prefix code, index) pairs
+     */
+
+    const int TABLE_SIZE = 8192;
+    std::vector<int> keys(TABLE_SIZE, -1);
+    std::vector<short> codes(TABLE_SIZE);
+
+    const int clear_code = 1 << min_code_size;
+    int code_size = min_code_size + 1;
+    int max_code = clear_code + 1;      // end of information code
+
+    std::vector<unsigned char> block;
+    uint32_t bits = 0;
+    int bit_count = 0;
+
+    auto emit = [&](int code) {
+        bits |= code << bit_count;
+        bit_count += code_size;
+        while (bit_count >= 8) {
+            block.push_back(bits & 0xFF);
+            bits >>= 8;
+            bit_count -= 8;
+            if (block.size() == 255) {
+                out.push_back(255);
+                out.insert(out.end(), block.begin(), block.end());
+                block.clear();
+            }
+        }
+    };
+
+    out.push_back(min_code_size);
+    emit(clear_code);
+
+    int prefix = indices[0];
+    for (size_t pos = 1; pos < indices.size(); ++pos) {
+        int key = (prefix << 8) | indices[pos];
+        int slot = (key * 2654435761u) >> 19;   // 13-bit hash
+        while (keys[slot] != -1 && keys[slot] != key) {
+            slot = (slot + 1) & (TABLE_SIZE - 1);
+        }
+
+        if (keys[slot] == key) {    // run continues
+            prefix = codes[slot];
+            continue;
+        }
+
+        emit(prefix);
+        keys[slot] = key;
+        codes[slot] = ++max_code;
+        if (max_code >= (1 << code_size)) {
+            ++code_size;
+        }
+        if (max_code == 4095) {     // dictionary full, start over
+            emit(clear_code);
+            std::fill(keys.begin(), keys.end(), -1);
+            code_size = min_code_size + 1;
+            max_code = clear_code + 1;
+        }
+        prefix = indices[pos];
+    }
+
+    emit(prefix);
+    emit(clear_code + 1);
+    if (bit_count > 0) {
+        block.push_back(bits & 0xFF);
+    }
+    if (!block.empty()) {
+        out.push_back(block.size());
+        out.insert(out.end(), block.begin(), block.end());
+    }
+    out.push_back(0);   // block terminator
+}
+
+void frame_capture::write_gif(const frame& item) {
+    /*
+     * Encodes a frame as a GIF image with its own color table
+     * The image is held back until the next frame arrives, since its delay covers the dropped duplicates
+     * CHIP-8 frames use a 2-color table, MegaChip frames the ROM palette with blended colors matched to the nearest entry
+     */
+
+    if (!have_written) {
+        std::vector<unsigned char> header = { 'G', 'I', 'F', '8', '9', 'a' };
+        put_short(header, width);
+        put_short(header, height);
+        header.insert(header.end(), { 0x00, 0x00, 0x00 });     // no global color table
+        // loop forever
+        header.insert(header.end(), { 0x21, 0xFF, 0x0B, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 0x03, 0x01, 0x00, 0x00, 0x00 });
+        std::fwrite(header.data(), 1, header.size(), file);
+    }
+    else {
+        flush_gif_image(item.number);
+    }
+
+    std::array<uint32_t, 256> table = {};
+    int table_bits = 1;
+    if (item.megachip) {
+        table = item.palette;
+        table[0] = 0xFF000000;  // transparent entry shows as black
+        table_bits = 8;
+    }
+    else {
+        table[0] = 0xFF000000;
+        table[1] = 0xFFFFFFFF;
+    }
+
+    std::unordered_map<uint32_t, unsigned char> nearest;
+    std::vector<unsigned char> indices(rgb.size());
+    for (size_t pos = 0; pos < rgb.size(); ++pos) {
+        uint32_t color = rgb[pos] & 0xFFFFFF;
+        auto found = nearest.find(color);
+        if (found != nearest.end()) {
+            indices[pos] = found->second;
+            continue;
+        }
+
+        int best = 0;
+        int best_distance = 0x7FFFFFFF;
+        for (int entry = 0; entry < (1 << table_bits); ++entry) {
+            int dr = (int) ((color >> 16) & 0xFF) - (int) ((table[entry] >> 16) & 0xFF);
+            int dg = (int) ((color >> 8) & 0xFF) - (int) ((table[entry] >> 8) & 0xFF);
+            int db = (int) (color & 0xFF) - (int) (table[entry] & 0xFF);
+            int distance = dr * dr + dg * dg + db * db;
+            if (distance < best_distance) {
+                best = entry;
+                best_distance = distance;
+            }
+        }
+        nearest[color] = best;
+        indices[pos] = best;
+    }
+
+    // image descriptor with local color table
+    encoded.clear();
+    encoded.push_back(0x2C);
+    put_short(encoded, 0);
+    put_short(encoded, 0);
+    put_short(encoded, width);
+    put_short(encoded, height);
+    encoded.push_back(0x80 | (table_bits - 1));
+    for (int entry = 0; entry < (1 << table_bits); ++entry) {
+        encoded.push_back((table[entry] >> 16) & 0xFF);
+        encoded.push_back((table[entry] >> 8) & 0xFF);
+        encoded.push_back(table[entry] & 0xFF);
+    }
+
+    lzw_encode(indices, table_bits < 2 ? 2 : table_bits, encoded);
+}
+
+void frame_capture::flush_gif_image(unsigned long long next_number) {
+    /*
+     * Writes the held back image, shown until next_number
+     * Delays are in hundredths of a second, rounded on the absolute time so they don't drift
+     */
+
+    int delay = (int) (next_number * 100 / 60 - written_number * 100 / 60);
+
+    unsigned char control[] = { 0x21, 0xF9, 0x04, 0x04, (unsigned char) (delay & 0xFF), (unsigned char) (delay >> 8), 0x00, 0x00 };
+    std::fwrite(control, 1, sizeof(control), file);
+    std::fwrite(encoded.data(), 1, encoded.size(), file);
+}
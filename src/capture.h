@@ -0,0 +1,64 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "spsc_queue.h"
+
+class chip8;
+
+class frame_capture {
+public:
+    frame_capture(const char* path);    // .y4m or .gif, chosen by extension
+    ~frame_capture();                   // writes out queued frames and closes the file
+
+    bool is_open() const;
+    void tap(const chip8& game);        // once per emulated frame, on the emulation thread
+
+    unsigned long long dropped() const;     // frames lost because the writer fell behind
+
+private:
+    struct frame {
+        unsigned long long number = 0;      // emulated frame since capture started
+        int width = 0;
+        int height = 0;
+        bool megachip = false;
+        std::vector<unsigned char> pixels;  // CHIP-8 display packed to 1 bit per pixel
+        std::vector<uint32_t> colors;       // MegaChip frame, ARGB
+        std::array<uint32_t, 256> palette;  // MegaChip palette, used to pick GIF colors
+
+        frame();
+    };
+
+    FILE* file;
+    bool gif;
+
+    // emulation thread
+    frame staging;                      // packed here first so duplicates never touch the queue
+    uint64_t last_hash = 0;
+    bool have_last = false;
+    unsigned long long frame_number = 0;
+    std::atomic<unsigned long long> dropped_frames{0};
+
+    spsc_queue<frame, 64> queue;
+    std::atomic<bool> stopping{false};
+    std::thread writer;
+
+    // writer thread
+    int width = 0;                          // stream size, fixed by the first frame
+    int height = 0;
+    std::vector<uint32_t> rgb;              // current frame scaled to the stream size
+    unsigned long long written_number = 0;  // number of the last frame written
+    bool have_written = false;
+    std::vector<unsigned char> encoded;     // Y4M planes or GIF image data of the last frame
+
+    void write_frames();
+    void unpack(const frame& item);
+    void write_y4m(const frame& item);
+    void write_gif(const frame& item);
+    void flush_gif_image(unsigned long long next_number);
+};
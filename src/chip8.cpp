@@ -3,34 +3,60 @@
 #include <memory>
 #include <fstream>
 #include <cstring>
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
 
-#include "chip8.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "chip8.h"
+#include "hash.h"
+#include "state.h"
+
+
+// shared by every machine, copied into memory by initialize()
+const std::array<unsigned char, 80> chip8::fontset = {
+    0xF0, 0x90, 0x90, 0x90, 0xF0,   // 0
+    0x20, 0x60, 0x20, 0x20, 0x70,   // 1
+    0xF0, 0x10, 0xF0, 0x80, 0xF0,   // 2
+    0xF0, 0x10, 0xF0, 0x10, 0xF0,   // 3
+    0x90, 0x90, 0xF0, 0x10, 0x10,   // 4
+    0xF0, 0x80, 0xF0, 0x10, 0xF0,   // 5
+    0xF0, 0x80, 0xF0, 0x90, 0xF0,   // 6
+    0xF0, 0x10, 0x20, 0x40, 0x40,   // 7
+    0xF0, 0x90, 0xF0, 0x90, 0xF0,   // 8
+    0xF0, 0x90, 0xF0, 0x10, 0xF0,   // 9
+    0xF0, 0x90, 0xF0, 0x90, 0x90,   // A
+    0xE0, 0x90, 0xE0, 0x90, 0xE0,   // B
+    0xF0, 0x80, 0x80, 0x80, 0xF0,   // C
+    0xE0, 0x90, 0x90, 0x90, 0xE0,   // D
+    0xF0, 0x80, 0xF0, 0x80, 0xF0,   // E
+    0xF0, 0x80, 0xF0, 0x80, 0x80,   // F
+};
 
 chip8::chip8() {
-    fontset = {
-        0xF0, 0x90, 0x90, 0x90, 0xF0,   // 0
-        0x20, 0x60, 0x20, 0x20, 0x70,   // 1
-        0xF0, 0x10, 0xF0, 0x80, 0xF0,   // 2
-        0xF0, 0x10, 0xF0, 0x10, 0xF0,   // 3
-        0x90, 0x90, 0xF0, 0x10, 0x10,   // 4
-        0xF0, 0x80, 0xF0, 0x10, 0xF0,   // 5
-        0xF0, 0x80, 0xF0, 0x90, 0xF0,   // 6
-        0xF0, 0x10, 0x20, 0x40, 0x40,   // 7
-        0xF0, 0x90, 0xF0, 0x90, 0xF0,   // 8
-        0xF0, 0x90, 0xF0, 0x10, 0xF0,   // 9
-        0xF0, 0x90, 0xF0, 0x90, 0x90,   // A
-        0xE0, 0x90, 0xE0, 0x90, 0xE0,   // B
-        0xF0, 0x80, 0x80, 0x80, 0xF0,   // C
-        0xE0, 0x90, 0x90, 0x90, 0xE0,   // D
-        0xF0, 0x80, 0xF0, 0x80, 0xF0,   // E
-        0xF0, 0x80, 0xF0, 0x80, 0x80,   // F
-    };
-
     initialize();
 }
 
 void chip8::initialize() {
+    // clear memory
+    memory.fill(0);
+
+    // load fonts to memory
+    std::copy(fontset.begin(), fontset.end(), memory.begin());
+    rom_image.reset();
+
+    reset_machine();
+}
+
+void chip8::reset_machine() {
+    /*
+     * Puts everything except memory back to its power-on state
+     */
+
     pc = 0x200;     // program starts at location 0x200
     opcode = 0;     // reset opcode
     I = 0;          // reset index register
@@ -40,11 +66,6 @@ void chip8::initialize() {
     delay_timer = 0;
     sound_timer = 0;
 
-    // clear memory
-    for (auto& byte : memory) {
-        byte = 0;
-    }
-
     // clear registers V0 - VF
     for (auto& reg : V) {
         reg = 0;
@@ -55,38 +76,117 @@ void chip8::initialize() {
         level = 0;
     }
     
-    // clear keyboard
-    for (auto& key : keyboard) {
-        key = 0;
-    }
+    // release keys
+    keys = 0;
+    keys_read = false;
+
+    unknown_opcodes = 0;
 
     // clear display
     clear_display();
-
-    
-    // load fonts to memory
-    for (int i = 0; i < 80; ++i) {
-        memory[i] = fontset[i];
-    }
-
-    srand(time(NULL));
+    disable_megachip();
+    mega_sound = digitized_sound();
+
+    // seed random number generator (xorshift state must not be 0)
+    rng_state = rng_seed != 0 ? rng_seed : (uint64_t) time(NULL) * 0x9E3779B97F4A7C15ULL;
+    rng_state |= 1;
+
+    // reset frame hash, every row is rehashed at the end of the next frame
+    frame_count = 0;
+    frame_hash = 0;
+    display_hash = 0;
+    mega_hash = 0;
+    row_hashes.fill(0);
+    dirty_rows = 0xFFFFFFFF;
+
+    // all of memory may have changed
+    dirty_pages = ALL_PAGES;
+    frame_pages = ALL_PAGES;
+    touched_pages = ALL_PAGES;
 }
 
 void chip8::clear_display() {
     for (auto& pixel : display) {
         pixel = 0;
     }
+    dirty_rows = 0xFFFFFFFF;
 }
 
 void chip8::reset() {
     /*
      * Restarts current game
+     * Only the memory pages written since the ROM was loaded are copied back from rom_image
      */
 
-    std::array<unsigned char, 4096> backup;     // array to hold rom data
-    std::memcpy(&backup, &memory, 4096);
-    initialize();   // reset all components
-    std::memcpy(&memory, &backup, 4096);    // restore rom data
+    if (!rom_image) {   // no ROM loaded
+        initialize();
+        return;
+    }
+
+    uint64_t pages = touched_pages;
+    for (unsigned int page = 0; page < 4096 / MEMORY_PAGE_SIZE; ++page) {
+        if (pages & (1ULL << page)) {
+            std::memcpy(memory.data() + page * MEMORY_PAGE_SIZE, rom_image->data() + page * MEMORY_PAGE_SIZE, MEMORY_PAGE_SIZE);
+        }
+    }
+
+    // extended memory is not paged, restore all of it, or drop it if only 0011 allocated it
+    if (rom_image->size() == 4096) {
+        std::vector<unsigned char>().swap(ext_memory);
+    }
+    else if (!ext_memory.empty()) {
+        auto spill = rom_image->begin() + 4096;
+        auto end = std::copy(spill, rom_image->end(), ext_memory.begin());
+        std::fill(end, ext_memory.end(), 0);
+    }
+
+    reset_machine();
+    dirty_pages = pages;
+    frame_pages = pages;
+    touched_pages = 0;
+}
+
+chip8 chip8::clone() const {
+    /*
+     * Returns an independent copy of the machine, e.g. to search ahead from the current state
+     * rom_image is shared; the rest of a CHIP-8 machine is about 7 KiB of arrays, copied in a
+     * few hundred nanoseconds, which is cheaper than copy-on-write checks on every store
+     * Assigning to an existing machine (copy = game) does the same without allocating
+     * The copy does not read the input queue, which has a single consumer
+     */
+
+    chip8 copy = *this;
+    copy.input = NULL;
+    return copy;
+}
+
+static std::shared_ptr<const std::vector<unsigned char>> shared_rom_image(std::vector<unsigned char>&& image) {
+    /*
+     * Returns the one copy of image held for every machine that loaded the same bytes, so a fleet
+     * running one ROM keeps one image for reset() however the machines were created
+     * Images are found by content hash and go away with the last machine holding them
+     */
+
+    static std::mutex lock;
+    static std::unordered_multimap<uint64_t, std::weak_ptr<const std::vector<unsigned char>>> images;
+
+    uint64_t hash = hash64(image.data(), image.size());
+    std::lock_guard<std::mutex> guard(lock);
+    auto range = images.equal_range(hash);
+    for (auto entry = range.first; entry != range.second; ++entry) {
+        auto shared = entry->second.lock();
+        if (shared && *shared == image) {
+            return shared;
+        }
+    }
+
+    // new contents, a rare event, so this is also when the images nobody holds are dropped
+    for (auto entry = images.begin(); entry != images.end();) {
+        entry = entry->second.expired() ? images.erase(entry) : std::next(entry);
+    }
+    auto shared = std::make_shared<const std::vector<unsigned char>>(std::move(image));
+    images.emplace(hash, shared);
+    return shared;
 }
 
 bool chip8::load_rom(const char* rom_name) {
@@ -94,7 +194,7 @@ bool chip8::load_rom(const char* rom_name) {
     std::ifstream rom(rom_name, std::ios::in|std::ios::binary);
     
     if (!rom.is_open()) {     // Check if ROM was loaded
-        std::cout << "File not found" << std::endl;
+        std::cerr << "ROM not found: " << rom_name << std::endl;
         return false;
     }
     
@@ -103,21 +203,437 @@ bool chip8::load_rom(const char* rom_name) {
     int rom_size = rom.tellg();
     rom.seekg(0);   // rewind rom
 
-    if (rom_size > 4096 - 512) {    // ensure size of ROM is valid
-        std::cerr << "ROM size too large for memory" << std::endl;
+    if (rom_size < 0) {     // e.g. a directory
+        std::cerr << "Cannot read ROM: " << rom_name << std::endl;
         return false;
     }
 
-    char rom_data = 0;
-
-    for (int byte = 512; rom.get(rom_data); ++ byte) {
-        memory[byte] = (unsigned char) rom_data;
+    if (rom_size > (int) MEGA_MEMORY_SIZE - 512) {    // ensure size of ROM is valid
+        std::cerr << "ROM size too large for memory: " << rom_name << std::endl;
+        return false;
     }
 
+    std::vector<unsigned char> rom_data(rom_size);
+    rom.read((char*) rom_data.data(), rom_size);
     rom.close();
+
+    return load_rom(rom_data.data(), rom_data.size());
+}
+
+bool chip8::load_rom(const unsigned char* data, size_t size) {
+    /*
+     * Loads a ROM already in memory, e.g. from a fuzzer
+     * The first 3.5 KiB go to memory from 0x200, the rest to extended memory, which is released
+     * when the ROM fits without it
+     */
+
+    if (size > MEGA_MEMORY_SIZE - 512) {
+        return false;
+    }
+
+    size_t low_size = std::min<size_t>(size, 4096 - 512);
+    if (size > low_size) {    // MegaChip ROM spills over into extended memory
+        ext_memory.assign(MEGA_MEMORY_SIZE - 4096, 0);
+    }
+    else {      // nothing of an earlier MegaChip ROM stays readable
+        std::vector<unsigned char>().swap(ext_memory);
+    }
+
+    std::copy(data, data + low_size, memory.begin() + 512);
+    std::copy(data + low_size, data + size, ext_memory.begin());
+    for (unsigned int page = 512 / MEMORY_PAGE_SIZE; page < (512 + low_size + MEMORY_PAGE_SIZE - 1) / MEMORY_PAGE_SIZE; ++page) {
+        dirty_pages |= 1ULL << page;
+    }
+
+    // keep memory as loaded for reset(), followed by the part of the ROM in extended memory
+    std::vector<unsigned char> image(memory.begin(), memory.end());
+    image.insert(image.end(), data + low_size, data + size);
+    rom_image = shared_rom_image(std::move(image));
+    touched_pages = 0;
+    return true;
+}
+
+static void save_machine(const chip8& game, chip8_state* state, uint64_t pages) {
+    /*
+     * Fills in the chip8_state block, copying only the memory pages set in pages
+     */
+
+    for (unsigned int page = 0; page < 4096 / MEMORY_PAGE_SIZE; ++page) {
+        if (pages & (1ULL << page)) {
+            std::memcpy(state->memory + page * MEMORY_PAGE_SIZE, game.memory.data() + page * MEMORY_PAGE_SIZE, MEMORY_PAGE_SIZE);
+        }
+    }
+    std::memcpy(state->V, game.V.data(), sizeof(state->V));
+    std::memcpy(state->stack, game.stack.data(), sizeof(state->stack));
+    state->pc = game.pc;
+    state->opcode = game.opcode;
+    state->I = game.I;
+    state->sp = game.sp;
+    state->delay_timer = game.delay_timer;
+    state->sound_timer = game.sound_timer;
+    for (int key = 0; key < 16; ++key) {
+        state->keyboard[key] = (game.keys >> key) & 1;
+    }
+    std::memcpy(state->display, game.display.data(), sizeof(state->display));
+    state->rng_state = game.rng_state;
+    state->frame_count = game.frame_count;
+}
+
+void chip8::save_state(std::vector<unsigned char>& out) const {
+    /*
+     * Serializes the whole machine in the save state layout (state.h)
+     */
+
+    size_t size = sizeof(chip8_state);
+    uint32_t flags = 0;
+    if (!ext_memory.empty()) {
+        flags |= STATE_EXT_MEMORY;
+        size += ext_memory.size();
+    }
+    if (megachip) {
+        flags |= STATE_MEGACHIP;
+        size += sizeof(megachip_state);
+    }
+    out.resize(size);
+
+    chip8_state* state = (chip8_state*) out.data();
+    *state = chip8_state();
+    std::memcpy(state->magic, STATE_MAGIC, sizeof(STATE_MAGIC));
+    state->version = STATE_VERSION;
+    state->flags = flags;
+    save_machine(*this, state, ALL_PAGES);
+
+    unsigned char* next = out.data() + sizeof(chip8_state);
+    if (flags & STATE_EXT_MEMORY) {
+        std::memcpy(next, ext_memory.data(), ext_memory.size());
+        next += ext_memory.size();
+    }
+
+    if (flags & STATE_MEGACHIP) {
+        megachip_state* mega = (megachip_state*) next;
+        *mega = megachip_state();
+        std::memcpy(mega->palette, palette.data(), sizeof(mega->palette));
+        std::memcpy(mega->mega_back, mega_back.data(), sizeof(mega->mega_back));
+        std::memcpy(mega->mega_frame, mega_frame.data(), sizeof(mega->mega_frame));
+        std::memcpy(mega->mega_display, mega_display.data(), sizeof(mega->mega_display));
+        mega->sprite_width = sprite_width;
+        mega->sprite_height = sprite_height;
+        mega->screen_alpha = screen_alpha;
+        mega->blend_mode = blend_mode;
+        mega->collision_color = collision_color;
+        mega->sound_loop = mega_sound.loop;
+        mega->sound_address = mega_sound.address;
+        mega->sound_length = mega_sound.length;
+        mega->sound_rate = mega_sound.rate;
+        mega->sound_playing = mega_sound.playing;
+    }
+}
+
+void chip8::save_state(std::vector<unsigned char>& out, uint64_t pages) const {
+    /*
+     * Brings out, a state saved earlier from this machine, up to date
+     * Only the memory pages set in pages are copied; the caller ORs together
+     * frame_pages of every frame since out was saved
+     * MegaChip states are always saved whole
+     */
+
+    if (megachip || !ext_memory.empty() || out.size() != sizeof(chip8_state)) {
+        save_state(out);
+        return;
+    }
+    save_machine(*this, (chip8_state*) out.data(), pages);
+}
+
+bool chip8::load_state(const unsigned char* data, size_t size) {
+    /*
+     * Restores the machine from a save state, copying each field straight into place
+     * The state is checked before anything is changed
+     */
+
+    const chip8_state* state = (const chip8_state*) data;
+    if (size < sizeof(chip8_state) || std::memcmp(state->magic, STATE_MAGIC, sizeof(STATE_MAGIC)) != 0) {
+        std::cerr << "Not a save state" << std::endl;
+        return false;
+    }
+    if (state->version != STATE_VERSION) {
+        std::cerr << "Unsupported save state version " << state->version << std::endl;
+        return false;
+    }
+
+    // the size, and registers that index arrays, so a damaged or edited state cannot make the core
+    // read or write outside them
+    size_t expected = sizeof(chip8_state);
+    expected += (state->flags & STATE_EXT_MEMORY) ? MEGA_MEMORY_SIZE - 4096 : 0;
+    expected += (state->flags & STATE_MEGACHIP) ? sizeof(megachip_state) : 0;
+    bool known_flags = (state->flags & ~(STATE_EXT_MEMORY | STATE_MEGACHIP)) == 0;
+    if (size != expected || !known_flags || state->sp > stack.size() || state->pc >= memory.size() - 1) {
+        std::cerr << "Save state is damaged" << std::endl;
+        return false;
+    }
+
+    std::memcpy(memory.data(), state->memory, sizeof(state->memory));
+    std::memcpy(V.data(), state->V, sizeof(state->V));
+    std::memcpy(stack.data(), state->stack, sizeof(state->stack));
+    pc = state->pc;
+    opcode = state->opcode;
+    I = state->I;
+    sp = state->sp;
+    delay_timer = state->delay_timer;
+    sound_timer = state->sound_timer;
+    keys = 0;
+    for (int key = 0; key < 16; ++key) {
+        keys |= (state->keyboard[key] != 0) << key;
+    }
+    std::memcpy(display.data(), state->display, sizeof(state->display));
+    rng_state = state->rng_state;
+    frame_count = state->frame_count;
+
+    const unsigned char* next = data + sizeof(chip8_state);
+    if (state->flags & STATE_EXT_MEMORY) {
+        ext_memory.assign(next, next + (MEGA_MEMORY_SIZE - 4096));
+        next += MEGA_MEMORY_SIZE - 4096;
+    }
+    else {
+        std::vector<unsigned char>().swap(ext_memory);
+    }
+
+    if (state->flags & STATE_MEGACHIP) {
+        const megachip_state* mega = (const megachip_state*) next;
+        enable_megachip();
+        palette.assign(mega->palette, mega->palette + 256);
+        std::memcpy(mega_back.data(), mega->mega_back, sizeof(mega->mega_back));
+        std::memcpy(mega_frame.data(), mega->mega_frame, sizeof(mega->mega_frame));
+        std::memcpy(mega_display.data(), mega->mega_display, sizeof(mega->mega_display));
+        sprite_width = mega->sprite_width;
+        sprite_height = mega->sprite_height;
+        screen_alpha = mega->screen_alpha;
+        blend_mode = mega->blend_mode;
+        collision_color = mega->collision_color;
+        mega_sound.loop = mega->sound_loop;
+        mega_sound.address = mega->sound_address;
+        mega_sound.length = mega->sound_length;
+        mega_sound.rate = mega->sound_rate;
+        mega_sound.playing = mega->sound_playing;
+        mega_hash = hash64(mega_frame.data(), mega_frame.size() * sizeof(uint32_t));
+    }
+    else {
+        disable_megachip();
+        mega_sound = digitized_sound();
+    }
+
+    // rehash the whole display and redraw it
+    dirty_rows = 0xFFFFFFFF;
+    dirty_pages = ALL_PAGES;
+    frame_pages = ALL_PAGES;
+    touched_pages = ALL_PAGES;
+    update_frame_hash();
+    draw_flag = true;
+    sound_flag = true;
     return true;
 }
 
+bool chip8::save_state(const char* path) const {
+    std::vector<unsigned char> state;
+    save_state(state);
+
+    std::ofstream file(path, std::ios::out|std::ios::binary|std::ios::trunc);
+    if (!file.is_open() || !file.write((const char*) state.data(), state.size())) {
+        std::cerr << "Cannot write save state " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool chip8::load_state(const char* path) {
+    /*
+     * Maps the save state file and restores from the mapping, without reading it into a buffer first
+     */
+
+    int file = open(path, O_RDONLY);
+    if (file < 0) {
+        std::cout << "Save state not found" << std::endl;
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(file, &info) != 0 || info.st_size == 0) {
+        close(file);
+        std::cerr << "Save state is damaged" << std::endl;
+        return false;
+    }
+
+    void* mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Cannot map save state " << path << std::endl;
+        return false;
+    }
+
+    bool loaded = load_state((const unsigned char*) mapping, info.st_size);
+    munmap(mapping, info.st_size);
+    return loaded;
+}
+
+unsigned char chip8::read_memory(unsigned int address) const {
+    /*
+     * Reads a byte from the 4 KiB CHIP-8 memory or from MegaChip extended memory
+     * Addresses outside of allocated memory read as 0
+     */
+
+    if (address < 4096) {
+        return memory[address];
+    }
+
+    address -= 4096;
+    if (address < ext_memory.size()) {
+        return ext_memory[address];
+    }
+    return 0;
+}
+
+void chip8::write_memory(unsigned int address, unsigned char value) {
+    /*
+     * Writes a byte to the 4 KiB CHIP-8 memory or to MegaChip extended memory
+     * Writes outside of allocated memory are ignored
+     */
+
+    if (address < 4096) {
+        memory[address] = value;
+        dirty_pages |= 1ULL << (address / MEMORY_PAGE_SIZE);
+        touched_pages |= 1ULL << (address / MEMORY_PAGE_SIZE);
+        return;
+    }
+
+    address -= 4096;
+    if (address < ext_memory.size()) {
+        ext_memory[address] = value;
+    }
+}
+
+void chip8::enable_megachip() {
+    /*
+     * Switches to the 256x192 indexed display (0011)
+     */
+
+    megachip = true;
+    if (ext_memory.empty()) {
+        ext_memory.assign(MEGA_MEMORY_SIZE - 4096, 0);
+    }
+
+    mega_display.assign(MEGA_WIDTH * MEGA_HEIGHT, 0);
+    mega_back.assign(MEGA_WIDTH * MEGA_HEIGHT, 0xFF000000);
+    mega_frame.assign(MEGA_WIDTH * MEGA_HEIGHT, 0xFF000000);
+    if (palette.empty()) {  // palette may already be loaded by 02NN
+        palette.assign(256, 0);
+    }
+    sprite_width = 0;
+    sprite_height = 0;
+    screen_alpha = 0xFF;
+    blend_mode = 0;
+    collision_color = 0;
+    draw_flag = true;
+}
+
+void chip8::disable_megachip() {
+    /*
+     * Returns to the 64x32 display (0010) and releases the MegaChip buffers
+     */
+
+    megachip = false;
+    std::vector<unsigned char>().swap(mega_display);
+    std::vector<uint32_t>().swap(mega_back);
+    std::vector<uint32_t>().swap(mega_frame);
+    std::vector<uint32_t>().swap(palette);
+    draw_flag = true;
+}
+
+static uint32_t blend_pixel(uint32_t dst, uint32_t src, unsigned char mode) {
+    /*
+     * Blends an ARGB sprite pixel into an ARGB screen pixel
+     * Modes: 0 normal (source alpha), 1 25%, 2 50%, 3 75%, 4 additive, 5 multiply
+     */
+
+    int alpha = src >> 24;
+    uint32_t result = 0xFF000000;
+
+    for (int shift = 0; shift < 24; shift += 8) {
+        int d = (dst >> shift) & 0xFF;
+        int s = (src >> shift) & 0xFF;
+        int channel = 0;
+
+        switch (mode) {
+            case 1: channel = (d * 3 + s) / 4; break;
+            case 2: channel = (d + s) / 2; break;
+            case 3: channel = (d + s * 3) / 4; break;
+            case 4: channel = std::min(d + s, 0xFF); break;
+            case 5: channel = d * s / 0xFF; break;
+            default: channel = (s * alpha + d * (0xFF - alpha)) / 0xFF; break;
+        }
+        result |= channel << shift;
+    }
+    return result;
+}
+
+void chip8::draw_mega_sprite(int x, int y) {
+    /*
+     * Draws a sprite_width x sprite_height sprite of palette indices starting at I
+     * Index 0 is transparent, the rest are blended into the back buffer
+     * Sprites are clipped at the screen edges
+     * Set VF to 1 if a pixel lands on a pixel of the collision color
+     */
+
+    int width = sprite_width == 0 ? 256 : sprite_width;
+    int height = sprite_height == 0 ? 256 : sprite_height;
+    int visible_width = std::min(width, MEGA_WIDTH - x);
+    int visible_height = std::min(height, MEGA_HEIGHT - y);
+
+    V[0xF] = 0;
+
+    for (int row = 0; row < visible_height; ++row) {
+        unsigned int source = I + row * width;
+        int pos = (y + row) * MEGA_WIDTH + x;
+
+        for (int column = 0; column < visible_width; ++column, ++pos) {
+            unsigned char index = read_memory(source + column);
+            if (index == 0) {   // transparent
+                continue;
+            }
+
+            if (mega_display[pos] != 0 && mega_display[pos] == collision_color) {
+                V[0xF] = 1;
+            }
+            mega_display[pos] = index;
+            mega_back[pos] = blend_pixel(mega_back[pos], palette[index], blend_mode);
+        }
+    }
+}
+
+void chip8::flip_mega_frame() {
+    /*
+     * Shows the back buffer (faded by the screen alpha) and clears it for the next frame
+     */
+
+    if (screen_alpha == 0xFF) {
+        mega_frame = mega_back;
+    }
+    else {
+        for (int pos = 0; pos < MEGA_WIDTH * MEGA_HEIGHT; ++pos) {
+            uint32_t color = mega_back[pos];
+            uint32_t faded = 0xFF000000;
+            for (int shift = 0; shift < 24; shift += 8) {
+                faded |= ((((color >> shift) & 0xFF) * screen_alpha) / 0xFF) << shift;
+            }
+            mega_frame[pos] = faded;
+        }
+    }
+
+    mega_hash = hash64(mega_frame.data(), mega_frame.size() * sizeof(uint32_t));
+
+    std::fill(mega_back.begin(), mega_back.end(), 0xFF000000);
+    std::fill(mega_display.begin(), mega_display.end(), 0);
+    draw_flag = true;
+}
+
 void chip8::decrement_timers() {
     if (delay_timer > 0) {
         --delay_timer;
@@ -130,32 +646,182 @@ void chip8::decrement_timers() {
 
 void chip8::emulate_cycle() {
     // fetch opcode
+    CHIP8_CHECK(pc < memory.size() - 1, "fetch outside memory");
     opcode = (memory[pc] << 8) | memory[pc+1];
-    std::unique_ptr<unsigned short> op_ptr = std::make_unique<unsigned short>(opcode);
 
     // decode opcode
-    decode_opcode(op_ptr);
+    decode_opcode(&opcode);
 
-    // decrement timers
-    if (delay_timer > 0) {
-        --delay_timer;
+    pc += 2;
+}
+
+void chip8::emulate_frame() {
+    /*
+     * Runs one 60 Hz frame: CYCLES_PER_FRAME cycles, then the timers tick once
+     * and the frame hash is brought up to date
+     */
+
+    uint64_t cycle = frame_count * CYCLES_PER_FRAME;
+    uint64_t frame_end = cycle + CYCLES_PER_FRAME;
+    while (cycle < frame_end) {
+        // run straight up to the next input event, so an empty queue costs one check per frame
+        uint64_t run_to = std::min(apply_input(cycle), frame_end);
+        for (; cycle < run_to; ++cycle) {
+            emulate_cycle();
+        }
     }
 
-    if (sound_timer > 0) {
-        // make sound
-        --sound_timer;
+    end_frame();
+}
+
+void chip8::end_frame() {
+    decrement_timers();
+    update_frame_hash();
+    ++frame_count;
+
+    frame_pages = dirty_pages;
+    dirty_pages = 0;
+}
+
+uint64_t chip8::apply_input(uint64_t cycle) {
+    /*
+     * Sets keys from the queued events stamped at or before cycle
+     * Late events take effect now, as do events more than a frame ahead, which were stamped
+     * before a rewind, reset or state load moved frame_count back
+     */
+
+    if (input == NULL) {
+        return UINT64_MAX;
     }
 
-    pc += 2;
+    uint64_t horizon = (frame_count + 2) * CYCLES_PER_FRAME;
+    while (const input_event* event = input->consumer_slot()) {
+        if (event->cycle > cycle && event->cycle < horizon) {
+            return event->cycle;
+        }
+        keys = event->keys;
+        keys_read = false;
+        if (log_input) {
+            input_log.push_back({cycle, keys});
+        }
+        input->pop();
+    }
+    return UINT64_MAX;
+}
+
+static uint64_t pack_row(const unsigned char* pixels) {
+    /*
+     * Packs a 64-pixel display row (one 0/1 byte per pixel) into 64 bits
+     * The multiply gathers the low bit of each of 8 bytes into the top byte
+     */
+
+    uint64_t bits = 0;
+    for (int byte = 0; byte < 8; ++byte) {
+        uint64_t word;
+        std::memcpy(&word, pixels + byte * 8, 8);
+        bits |= (((word & 0x0101010101010101ULL) * 0x0102040810204080ULL) >> 56) << (byte * 8);
+    }
+    return bits;
 }
 
-void chip8::decode_opcode(std::unique_ptr<unsigned short>& opcode) {
+void chip8::update_frame_hash() {
+    /*
+     * frame_hash identifies what is on screen (and optionally in memory) at the end of a frame
+     * The display hash is the XOR of one mixed, packed word per row, so only the rows
+     * drawn to since the last frame are rehashed
+     */
+
+    while (dirty_rows != 0) {
+        int row = __builtin_ctz(dirty_rows);
+        dirty_rows &= dirty_rows - 1;
+
+        display_hash ^= row_hashes[row];
+        row_hashes[row] = mix64(pack_row(&display[row * 64]) ^ ((row + 1) * 0x9E3779B97F4A7C15ULL));
+        display_hash ^= row_hashes[row];
+    }
+
+    frame_hash = megachip ? mega_hash : display_hash;
+    if (hash_memory) {
+        frame_hash = hash64(memory.data(), memory.size(), frame_hash);
+    }
+}
+
+void chip8::pack_display(uint64_t* rows) const {
+    for (int row = 0; row < 32; ++row) {
+        rows[row] = pack_row(&display[row * 64]);
+    }
+}
+
+unsigned char chip8::random_byte() {
+    /*
+     * xorshift64* generator, so a run can be repeated from its seed
+     */
+
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (rng_state * 0x2545F4914F6CDD1DULL) >> 56;
+}
+
+bool chip8::draw_sprite(unsigned int address, int X, int Y, int height) {
+    /*
+     * Draws the height rows of sprite data at address to the 64x32 display at X, Y, as DXYN does
+     * Returns whether a pixel was unset (the value of VF)
+     */
+
+    bool collision = false;
+    unsigned char pixels = 0;           // pixels in memory (starting at address)
+
+    // traverse over rows
+    for (int row = 0; row < height; ++row) {
+        pixels = read_memory(address + row);
+        int abs_row = Y + row;
+
+        // traverse over columns
+        for (int column = 0; column < 8; ++column) {
+            int abs_column = X + column;
+            int pos = (abs_column + (abs_row * 64)) % 2048;
+            unsigned char& pixel_on_display = display[pos];  // current pixel on screen
+            char pixel_in_memory = pixels & (0x80 >> column);
+
+            // check if pixel in memory is 1
+            if (pixel_in_memory != 0) {
+                if (pixel_on_display == 1) { // pixel is unset
+                    collision = true;
+                }
+                pixel_on_display ^= 1;  // flip corresponding pixel
+                dirty_rows |= 1u << (pos >> 6);
+            }
+        }
+    }
+
+    draw_flag = true;
+    return collision;
+}
+
+void chip8::decode_opcode(const unsigned short* opcode) {
     switch (*opcode & 0xF000) {
         // 0NNN ignored
-        case 0x0000: {   // 00E0 or 00EE
+        case 0x0000: {   // 00E0, 00EE, or MegaChip 0010, 0011, 00BN, 01NN - 09NN
+            if (*opcode & 0x0F00) {
+                // 01NN - 09NN only exist in MegaChip mode, elsewhere they are the ignored 0NNN
+                if (megachip) {
+                    decode_megachip_opcode(*opcode);
+                }
+                else {
+                    unknown_opcode(*opcode);
+                }
+                break;
+            }
+
             switch (*opcode & 0x00FF) {
                 case 0x00E0: {    // 00E0
                     // clear the screen
+                    // in MegaChip mode, show the finished frame and clear the back buffer
+                    if (megachip) {
+                        flip_mega_frame();
+                        break;
+                    }
                     clear_display();
                     draw_flag = true;
                     break;
@@ -163,13 +829,36 @@ void chip8::decode_opcode(std::unique_ptr<unsigned short>& opcode) {
 
                 case 0x00EE: {   // 00EE
                     // return from subroutine
+                    CHIP8_CHECK(sp > 0, "return with an empty stack");
                     --sp;
                     pc = stack[sp];
                     break;
                 }
 
+                case 0x0010: {   // 0010
+                    // disable MegaChip mode
+                    disable_megachip();
+                    break;
+                }
+
+                case 0x0011: {   // 0011
+                    // enable MegaChip mode
+                    enable_megachip();
+                    break;
+                }
+
                 default:
-                    std::cout << "Unknown Opcode:" << *opcode << std::endl;
+                    if (megachip && (*opcode & 0x00F0) == 0x00B0) {   // 00BN
+                        // scroll the MegaChip back buffer up N lines
+                        int lines = *opcode & 0x000F;
+                        int shifted = lines * MEGA_WIDTH;
+                        std::copy(mega_back.begin() + shifted, mega_back.end(), mega_back.begin());
+                        std::fill(mega_back.end() - shifted, mega_back.end(), 0xFF000000);
+                        std::copy(mega_display.begin() + shifted, mega_display.end(), mega_display.begin());
+                        std::fill(mega_display.end() - shifted, mega_display.end(), 0);
+                        break;
+                    }
+                    unknown_opcode(*opcode);
                     break;
             }
             break;
@@ -184,6 +873,7 @@ void chip8::decode_opcode(std::unique_ptr<unsigned short>& opcode) {
 
         case 0x2000: {   // 2NNN
             // execute subroutine starting at NNN
+            CHIP8_CHECK(sp < stack.size(), "call with a full stack");
             stack[sp] = pc;    // save current address
             ++sp;
             pc = *opcode & 0x0FFF;
@@ -341,7 +1031,7 @@ void chip8::decode_opcode(std::unique_ptr<unsigned short>& opcode) {
                 }
 
                 default:
-                    std::cout << "Unknown Opcode:" << *opcode << std::endl;
+                    unknown_opcode(*opcode);
                     break;
             }
             break;
@@ -376,8 +1066,7 @@ void chip8::decode_opcode(std::unique_ptr<unsigned short>& opcode) {
             // VX = number & mask
             unsigned char mask = *opcode & 0x00FF;      // mask = NN
             unsigned char& VX = V[(*opcode & 0x0F00) >> 8];
-            // srand(time(NULL));
-            unsigned char rand_num = rand() % (0xFF + 1);    // range of 00 - FF
+            unsigned char rand_num = random_byte();    // range of 00 - FF
             VX = rand_num & mask;
             break;
         }
@@ -389,32 +1078,13 @@ void chip8::decode_opcode(std::unique_ptr<unsigned short>& opcode) {
             int X = V[(*opcode & 0x0F00) >> 8];    // starting X point (column)
             int Y = V[(*opcode & 0x00F0) >> 4];    // starting y point (row)
             int height = *opcode & 0x000F;  // number of rows (N)
-            unsigned char pixels = 0;           // pixels in memory (starting at address I)
-
-            V[0xF] = 0;
-
-            // traverse over rows
-            for (int row = 0; row < height; ++row) {
-                pixels = memory[I + row];
-                int abs_row = Y + row;
-                
-                // traverse over columns
-                for (int column = 0; column < 8; ++column) {
-                    int abs_column = X + column;
-                    unsigned char& pixel_on_display = display[(abs_column + (abs_row * 64)) % 2048];  // current pixel on screen
-                    char pixel_in_memory = pixels & (0x80 >> column);
-                    
-                    // check if pixel in memory is 1
-                    if (pixel_in_memory != 0) {
-                        if (pixel_on_display == 1) { // pixel is unset
-                            V[0xF] = 1;
-                        }
-                        pixel_on_display ^= 1;  // flip corresponding pixel
-                    }
-                }
+
+            if (megachip) {     // N is ignored, sprite size is set by 03NN and 04NN
+                draw_mega_sprite(X, Y);
+                break;
             }
 
-            draw_flag = true;
+            V[0xF] = draw_sprite(I, X, Y, height);
             break;
         }
 
@@ -423,7 +1093,8 @@ void chip8::decode_opcode(std::unique_ptr<unsigned short>& opcode) {
                 case 0x009E: {   // EX9E
                     // skip next instruction if key corresponding to value of VX is pressed
                     unsigned char VX = V[(*opcode & 0x0F00) >> 8];
-                    if (keyboard[VX] == 1) {    // key is pressed
+                    keys_read = true;
+                    if (keys & (1 << (VX & 0xF))) {    // key is pressed
                         pc += 2;
                     }
                     break;
@@ -432,14 +1103,15 @@ void chip8::decode_opcode(std::unique_ptr<unsigned short>& opcode) {
                 case 0x00A1: {   // EXA1
                     // skip next instruction if key corresponding to value of VX is not pressed
                     unsigned char VX = V[(*opcode & 0x0F00) >> 8];
-                    if (keyboard[VX] == 0) {    // key is not pressed
+                    keys_read = true;
+                    if (!(keys & (1 << (VX & 0xF)))) {    // key is not pressed
                         pc += 2;
                     }
                     break;
                 }
 
                 default:
-                    std::cout << "Unknown Opcode:" << *opcode << std::endl;
+                    unknown_opcode(*opcode);
                     break;
             }
             break;
@@ -457,19 +1129,19 @@ void chip8::decode_opcode(std::unique_ptr<unsigned short>& opcode) {
                 case 0x000A: {   // FX0A
                     // wait for a keypress and store its value in VX
                     unsigned char& VX = V[(*opcode & 0x0F00) >> 8];
-                    bool pressed = false;    // state of keys
-                    
+                    keys_read = true;
+
+                    if (keys == 0) {    // no key is pressed, run this instruction again
+                        pc -= 2;
+                        break;
+                    }
+
                     for (int key = 0; key < 16; ++key) {    
-                        if (keyboard[key] != 0) {   // a key is pressed
-                            pressed = true;
+                        if (keys & (1 << key)) {   // lowest key pressed
                             VX = key;
                             break;
                         }
                     }
-
-                    if (!pressed) {    // no key is pressed
-                        return;
-                    }
                     break;
                 }
 
@@ -513,9 +1185,9 @@ void chip8::decode_opcode(std::unique_ptr<unsigned short>& opcode) {
                 case 0x0033: {   // FX33
                     // Store the BCD of the value in register VX at addresses I, I+1, and I+2
                     unsigned char VX = V[(*opcode & 0x0F00) >> 8];
-                    memory[I] = VX / 100;               // extract 1st digit
-                    memory[I + 1] = (VX % 100) / 10;    // extract 2nd digit
-                    memory[I + 2] = VX % 10;            // extract 3rd digit
+                    write_memory(I, VX / 100);              // extract 1st digit
+                    write_memory(I + 1, (VX % 100) / 10);   // extract 2nd digit
+                    write_memory(I + 2, VX % 10);           // extract 3rd digit
                     break;
                 }
 
@@ -523,7 +1195,7 @@ void chip8::decode_opcode(std::unique_ptr<unsigned short>& opcode) {
                     // store values of V0-VX in memory starting at address I
                     char X = (*opcode & 0x0F00) >> 8;
                     for (int reg = 0; reg <= X; ++reg) {
-                        memory[I + reg] = V[reg];
+                        write_memory(I + reg, V[reg]);
                     }
                     break;
                 }
@@ -532,20 +1204,115 @@ void chip8::decode_opcode(std::unique_ptr<unsigned short>& opcode) {
                     // fill V0-VX with values at memory from address I
                     char X = (*opcode & 0x0F00) >> 8;
                     for (int reg = 0; reg <= X; ++reg) {
-                        V[reg] = memory[I + reg];
+                        V[reg] = read_memory(I + reg);
                     }
                     break;
                 }
 
                 default:
-                    std::cout << "Unknown Opcode:" << *opcode << std::endl;
+                    unknown_opcode(*opcode);
                     break;
             }
             break;
         }
         
         default:
-            std::cout << "Unknown Opcode:" << *opcode << std::endl;
+            unknown_opcode(*opcode);
             break;
     }
 }
+
+void chip8::unknown_opcode(unsigned short opcode) {
+    ++unknown_opcodes;
+    if (report_unknown) {
+        std::cout << "Unknown Opcode:" << opcode << std::endl;
+    }
+}
+
+void chip8::checked_fault(const char* what) const {
+    std::cerr << "CHIP8_CHECKED: " << what << " at pc " << std::hex << pc << ", opcode " << opcode << std::dec << std::endl;
+    std::abort();
+}
+
+void chip8::decode_megachip_opcode(unsigned short opcode) {
+    /*
+     * Decodes the MegaChip extensions 01NN - 09NN
+     */
+
+    unsigned char NN = opcode & 0x00FF;
+
+    switch (opcode & 0x0F00) {
+        case 0x0100: {   // 01NN NNNN
+            // load the 24-bit address NNNNNN into I
+            I = (NN << 16) | (read_memory(pc + 2) << 8) | read_memory(pc + 3);
+            pc += 2;    // skip the second half of the instruction
+            break;
+        }
+
+        case 0x0200: {   // 02NN
+            // load NN ARGB colors from I into palette entries 1 - NN
+            if (palette.empty()) {
+                palette.assign(256, 0);
+            }
+            for (int color = 0; color < NN && color < 255; ++color) {
+                unsigned int address = I + color * 4;
+                palette[color + 1] = (read_memory(address) << 24) | (read_memory(address + 1) << 16)
+                                   | (read_memory(address + 2) << 8) | read_memory(address + 3);
+            }
+            break;
+        }
+
+        case 0x0300: {   // 03NN
+            // set sprite width to NN (0 means 256)
+            sprite_width = NN;
+            break;
+        }
+
+        case 0x0400: {   // 04NN
+            // set sprite height to NN (0 means 256)
+            sprite_height = NN;
+            break;
+        }
+
+        case 0x0500: {   // 05NN
+            // set screen alpha to NN
+            screen_alpha = NN;
+            break;
+        }
+
+        case 0x0600: {   // 060N
+            // play digitized sound at I, looping if N is 0
+            // header: 16-bit sample rate, 24-bit length, 1 unused byte
+            mega_sound.rate = (read_memory(I) << 8) | read_memory(I + 1);
+            mega_sound.length = (read_memory(I + 2) << 16) | (read_memory(I + 3) << 8) | read_memory(I + 4);
+            mega_sound.address = I + 6;
+            mega_sound.loop = (opcode & 0x000F) == 0;
+            mega_sound.playing = true;
+            sound_flag = true;
+            break;
+        }
+
+        case 0x0700: {   // 0700
+            // stop digitized sound
+            mega_sound.playing = false;
+            sound_flag = true;
+            break;
+        }
+
+        case 0x0800: {   // 080N
+            // set sprite blend mode to N
+            blend_mode = (opcode & 0x000F) <= 5 ? (opcode & 0x000F) : 0;
+            break;
+        }
+
+        case 0x0900: {   // 09NN
+            // set collision color to palette entry NN
+            collision_color = NN;
+            break;
+        }
+
+        default:
+            unknown_opcode(opcode);
+            break;
+    }
+}
\ No newline at end of file
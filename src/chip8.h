@@ -1,15 +1,52 @@
+#pragma once
+
 #include <array>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "spsc_queue.h"
+
+// cycles emulated per 60 Hz frame
+const int CYCLES_PER_FRAME = 14;
+
+// MegaChip display resolution
+const int MEGA_WIDTH = 256;
+const int MEGA_HEIGHT = 192;
+
+// MegaChip addresses are 24-bit; everything above the classic 4 KiB lives in ext_memory
+const unsigned int MEGA_MEMORY_SIZE = 0x2000000;   // 32 MiB
+
+// writes to the 4 KiB memory are tracked in 64-byte pages, one bit per page
+const unsigned int MEMORY_PAGE_SIZE = 64;
+const uint64_t ALL_PAGES = ~0ULL;
+
+// CHIP8_CHECKED builds stop with a message when a program would make the core read or write
+// outside its arrays, e.g. for fuzzing; other builds do no checks
+#ifdef CHIP8_CHECKED
+#define CHIP8_CHECK(condition, what) do { if (!(condition)) checked_fault(what); } while (0)
+#else
+#define CHIP8_CHECK(condition, what) do {} while (0)
+#endif
+
+// key change taking effect at an emulated cycle, counted as frame_count * CYCLES_PER_FRAME + cycle within the frame
+struct input_event {
+    uint64_t cycle;
+    unsigned short keys;    // keys held from that cycle on
+};
+using input_queue = spsc_queue<input_event, 256>;
 
 class chip8 {
 public:
     chip8();
     
     std::array<unsigned char, 4096> memory;     // memory array
+    std::vector<unsigned char> ext_memory;      // MegaChip memory above 0x1000 (allocated on demand)
     unsigned short opcode;                      // current opcode
     
     std::array<unsigned char, 16> V;            // registers
     unsigned short pc;                          // program counter
-    unsigned short I;                           // address pointer or index register
+    unsigned int I;                             // address pointer or index register (24-bit in MegaChip mode)
     
     std::array<unsigned short, 16> stack;       // stack levels
     unsigned char sp;                           // stack pointer
@@ -17,18 +54,95 @@ public:
     unsigned char delay_timer;
     unsigned char sound_timer;
 
-    std::array<unsigned char, 16> keyboard;
+    unsigned short keys = 0;                    // keys held, bit N is key N
+    input_queue* input = NULL;                  // timed key changes from another thread, applied at their cycle
+    bool log_input = false;                     // keep the events applied in input_log, for movies
+    std::vector<input_event> input_log;
+    bool keys_read = false;                     // EX9E, EXA1 or FX0A ran since input last changed keys
     std::array<unsigned char, 64 * 32> display;
-    std::array<unsigned char, 80> fontset;
+    static const std::array<unsigned char, 80> fontset;
     
     bool draw_flag = 0;     // for rendering to screen
+
+    // random number generator
+    uint64_t rng_seed = 0;      // seed used by initialize(), 0 seeds from the clock
+    uint64_t rng_state;
+
+    // frame hash, for regression tests and desync detection
+    unsigned long long frame_count = 0;     // frames emulated since initialize()
+    uint64_t frame_hash = 0;                // display (and memory if hash_memory) at the end of the last frame
+    bool hash_memory = false;               // include memory in frame_hash
+    uint64_t display_hash = 0;              // XOR of row_hashes
+    uint64_t mega_hash = 0;                 // MegaChip frame shown by the last 00E0
+    std::array<uint64_t, 32> row_hashes;    // hash of each display row
+    uint32_t dirty_rows = 0;                // display rows changed since the last frame
+
+    // memory pages written, for incremental snapshots
+    uint64_t dirty_pages = 0;               // pages written during the current frame
+    uint64_t frame_pages = 0;               // pages written during the last frame, all pages after a load or reset
+    uint64_t touched_pages = 0;             // pages that may differ from rom_image, set by write_memory and load_state
+
+    // memory right after load_rom, shared by every machine that loaded the same ROM and never changed
+    std::shared_ptr<const std::vector<unsigned char>> rom_image;
+
+    // MegaChip state
+    bool megachip = false;                      // MegaChip mode enabled (0011) or disabled (0010)
+    std::vector<unsigned char> mega_display;    // 256x192 palette indices, used for collisions
+    std::vector<uint32_t> mega_back;            // 256x192 ARGB buffer that sprites are blended into
+    std::vector<uint32_t> mega_frame;           // 256x192 ARGB buffer shown on screen, flipped by 00E0
+    std::vector<uint32_t> palette;              // 256 ARGB colors, index 0 is transparent
+    int sprite_width = 0;
+    int sprite_height = 0;
+    unsigned char screen_alpha = 0xFF;
+    unsigned char blend_mode = 0;
+    unsigned char collision_color = 0;
+
+    struct digitized_sound {
+        unsigned int address = 0;   // first sample
+        unsigned int length = 0;    // number of 8-bit unsigned samples
+        unsigned short rate = 0;    // samples per second
+        bool loop = false;
+        bool playing = false;
+    } mega_sound;
+    bool sound_flag = 0;    // mega_sound started or stopped
+
+    unsigned long long unknown_opcodes = 0;     // executed since the last initialize() or reset()
+    bool report_unknown = true;                 // print each unknown opcode
     
     // processes
     void initialize();
     void clear_display();
     bool load_rom(const char* rom_name);
+    bool load_rom(const unsigned char* data, size_t size);  // expects memory as after initialize()
     void emulate_cycle();
-    void decode_opcode(std::unique_ptr<unsigned short>& opcode);
+    void emulate_frame();   // CYCLES_PER_FRAME cycles and one timer tick
+    void end_frame();       // the timer tick and bookkeeping that follow a frame's cycles
+    uint64_t apply_input(uint64_t cycle);   // takes the events due by cycle, returns the cycle of the next one
+    void decode_opcode(const unsigned short* opcode);
+    void decode_megachip_opcode(unsigned short opcode);
+    bool draw_sprite(unsigned int address, int X, int Y, int height);   // DXYN outside MegaChip mode, returns VF
+    void unknown_opcode(unsigned short opcode);
+    [[noreturn]] void checked_fault(const char* what) const;    // CHIP8_CHECK failed
     void reset();   // restart game
+    void reset_machine();   // everything but memory
+    chip8 clone() const;    // independent copy, sharing rom_image
+
+    // save states (layout in state.h)
+    void save_state(std::vector<unsigned char>& out) const;
+    void save_state(std::vector<unsigned char>& out, uint64_t pages) const;    // updates an earlier state of this game
+    bool load_state(const unsigned char* data, size_t size);
+    bool save_state(const char* path) const;
+    bool load_state(const char* path);
     void decrement_timers();
+    void update_frame_hash();
+    void pack_display(uint64_t* rows) const;   // 32 rows, bit X of row Y is pixel (X, Y)
+    unsigned char random_byte();
+
+    // MegaChip processes
+    void enable_megachip();
+    void disable_megachip();
+    unsigned char read_memory(unsigned int address) const;
+    void write_memory(unsigned int address, unsigned char value);
+    void draw_mega_sprite(int x, int y);
+    void flip_mega_frame();
 };
\ No newline at end of file
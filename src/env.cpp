@@ -0,0 +1,112 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+#include "chip8.h"
+#include "vec_env.h"
+#include "hash.h"
+
+
+struct options {
+    int envs = 128;
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    int steps = 800;
+    bool check = false;                 // compare with the expected totals below
+    long long expect_reward = 0;
+    long long expect_dones = 0;
+    std::string spec;
+    std::string rom;
+};
+
+
+unsigned short action_at(int index, int step) {
+    // left or right (keys 4 and 6), switching at a different step for each environment
+    return (step * 7 + index * 13) % 11 < 5 ? 1 << 4 : 1 << 6;
+}
+
+int main(int argc, const char* argv[]) {
+    /*
+     * Steps a vec_env with scripted actions from seeds 0 to envs-1 and prints the total reward, the
+     * number of episodes that ended and a hash of every observation; --expect fails on other totals
+     */
+
+    options opts;
+    std::vector<std::string> paths;
+    for (int arg = 1; arg < argc; ++arg) {
+        std::string name = argv[arg];
+        if (name == "--envs" && arg + 1 < argc) {
+            opts.envs = std::max(1, std::atoi(argv[++arg]));
+        }
+        else if (name == "--threads" && arg + 1 < argc) {
+            opts.threads = std::max(1, std::atoi(argv[++arg]));
+        }
+        else if (name == "--steps" && arg + 1 < argc) {
+            opts.steps = std::max(0, std::atoi(argv[++arg]));
+        }
+        else if (name == "--expect" && arg + 2 < argc) {
+            opts.check = true;
+            opts.expect_reward = std::stoll(argv[++arg]);
+            opts.expect_dones = std::stoll(argv[++arg]);
+        }
+        else {
+            paths.push_back(name);
+        }
+    }
+
+    if (paths.size() != 2) {
+        std::cout << "Usage: ./chip-oct-env [--envs N] [--threads N] [--steps N] [--expect REWARD DONES] spec rom" << std::endl;
+        return 2;
+    }
+    opts.spec = paths[0];
+    opts.rom = paths[1];
+
+    env_spec spec;
+    chip8 game;
+    game.initialize();
+    if (!spec.load(opts.spec.c_str()) || !game.load_rom(opts.rom.c_str())) {
+        return 2;
+    }
+
+    vec_env env(game, spec, opts.envs, opts.threads);
+    std::vector<uint64_t> seeds(opts.envs);
+    std::vector<uint64_t> observations(opts.envs * vec_env::OBSERVATION_WORDS);
+    std::vector<unsigned short> actions(opts.envs);
+    std::vector<float> rewards(opts.envs);
+    std::vector<unsigned char> dones(opts.envs);
+
+    for (int index = 0; index < opts.envs; ++index) {
+        seeds[index] = index;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    env.reset(seeds.data(), observations.data());
+    uint64_t hash = hash64(observations.data(), observations.size() * sizeof(uint64_t), 0);
+    long long reward = 0;
+    long long ended = 0;
+    for (int step = 0; step < opts.steps; ++step) {
+        for (int index = 0; index < opts.envs; ++index) {
+            actions[index] = action_at(index, step);
+        }
+        env.step(actions.data(), observations.data(), rewards.data(), dones.data());
+
+        hash = hash64(observations.data(), observations.size() * sizeof(uint64_t), hash);
+        for (int index = 0; index < opts.envs; ++index) {
+            reward += rewards[index];
+            ended += dones[index];
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << opts.envs << " environments, " << opts.steps << " steps in " << seconds << " s on "
+              << opts.threads << " threads: reward " << reward << ", " << ended << " done, observations "
+              << std::hex << hash << std::dec << std::endl;
+
+    if (opts.check && (reward != opts.expect_reward || ended != opts.expect_dones)) {
+        std::cout << "FAIL, expected reward " << opts.expect_reward << " and " << opts.expect_dones << " done" << std::endl;
+        return 1;
+    }
+    return 0;
+}
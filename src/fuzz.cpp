@@ -0,0 +1,74 @@
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#include "chip8.h"
+
+
+/*
+ * libFuzzer target for the CPU core, built by "make fuzz" with CHIP8_CHECKED
+ * An input is a 2-byte little-endian ROM size, the ROM, and then key changes of 3 bytes each:
+ * frames to wait before the change, then the 16-bit key mask, low byte first
+ * The machine lives across inputs and is put back with chip8::reset, which restores only the pages
+ * the last input wrote, so a run costs its cycle budget and the ROM load
+ * With FUZZ_REPLAY ("make fuzz-replay") there is no libFuzzer: the files given are run once each,
+ * to replay a crash or a corpus with any compiler
+ */
+
+// cycle budget of one input, half a second of play keeps runs in the microseconds
+const int FUZZ_FRAMES = 30;
+
+// no larger, so a ROM never spills into the 32 MiB MegaChip memory
+const size_t FUZZ_ROM_SIZE = 4096 - 512;
+
+static chip8 game;
+static size_t loaded = 0;   // size of the last input's ROM
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    if (size < 2) {
+        return 0;
+    }
+    size_t rom_size = std::min({(size_t) (data[0] | data[1] << 8), size - 2, FUZZ_ROM_SIZE});
+    const uint8_t* rom = data + 2;
+    const uint8_t* script = rom + rom_size;
+    const uint8_t* end = data + size;
+
+    // back to the last ROM as loaded, then to an empty machine: only the last ROM's bytes are left to clear
+    game.rng_seed = 1;
+    game.report_unknown = false;
+    game.reset();
+    std::fill(game.memory.begin() + 512, game.memory.begin() + 512 + loaded, 0);
+    game.load_rom(rom, rom_size);
+    loaded = rom_size;
+
+    int change_frame = 0;
+    for (int frame = 0; frame < FUZZ_FRAMES; ++frame) {
+        while (end - script >= 3 && change_frame + script[0] <= frame) {
+            change_frame += script[0];
+            game.keys = script[1] | script[2] << 8;
+            script += 3;
+        }
+        game.emulate_frame();
+    }
+    return 0;
+}
+
+#ifdef FUZZ_REPLAY
+int main(int argc, const char* argv[]) {
+    for (int arg = 1; arg < argc; ++arg) {
+        std::ifstream file(argv[arg], std::ios::binary);
+        if (!file.is_open()) {
+            std::cerr << "Input not found: " << argv[arg] << std::endl;
+            return 2;
+        }
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        LLVMFuzzerTestOneInput(data.data(), data.size());
+    }
+    std::cout << argc - 1 << " inputs ran" << std::endl;
+    return 0;
+}
+#endif
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+inline uint64_t mix64(uint64_t value) {
+    // splitmix64 finalizer
+    value ^= value >> 30;
+    value *= 0xBF58476D1CE4E5B9ULL;
+    value ^= value >> 27;
+    value *= 0x94D049BB133111EBULL;
+    value ^= value >> 31;
+    return value;
+}
+
+inline uint64_t hash64(const void* data, size_t size, uint64_t seed = 0) {
+    /*
+     * Fast non-cryptographic 64-bit hash, 8 bytes per multiply
+     * Used to tell frames and memory images apart, not for hash tables under attack
+     */
+
+    const unsigned char* bytes = (const unsigned char*) data;
+    uint64_t hash = seed ^ (size * 0x9E3779B97F4A7C15ULL);
+    size_t pos = 0;
+
+    for (; pos + 8 <= size; pos += 8) {
+        uint64_t word;
+        std::memcpy(&word, bytes + pos, 8);
+        hash = (hash ^ word) * 0xBF58476D1CE4E5B9ULL;
+        hash ^= hash >> 29;
+    }
+
+    uint64_t tail = 0;
+    std::memcpy(&tail, bytes + pos, size - pos);
+    hash = (hash ^ tail) * 0x94D049BB133111EBULL;
+
+    // final avalanche
+    hash ^= hash >> 31;
+    hash *= 0xBF58476D1CE4E5B9ULL;
+    hash ^= hash >> 27;
+    return hash;
+}
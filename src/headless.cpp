@@ -0,0 +1,174 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <filesystem>
+
+#include "chip8.h"
+#include "input_script.h"
+
+
+namespace fs = std::filesystem;
+
+struct options {
+    unsigned long long frames = 600;
+    uint64_t seed = 1;
+    bool memory = false;        // include memory in the frame hashes
+    bool record = false;        // write golden files instead of checking them
+    fs::path roms;              // ROM file or directory of ROMs
+    fs::path golden;            // directory of <ROM>.golden and optional <ROM>.input files
+};
+
+
+bool run_rom(const options& opts, const fs::path& rom, std::vector<uint64_t>& hashes) {
+    /*
+     * Plays a ROM headless for opts.frames frames and collects the hash of every frame
+     */
+
+    chip8 game;
+    game.rng_seed = opts.seed;
+    game.hash_memory = opts.memory;
+    game.initialize();
+    if (!game.load_rom(rom.c_str())) {
+        return false;
+    }
+
+    input_script script;
+    fs::path input = opts.golden / (rom.filename().string() + ".input");
+    if (fs::exists(input) && !script.load(input.c_str())) {
+        return false;
+    }
+
+    hashes.clear();
+    for (unsigned long long frame = 0; frame < opts.frames; ++frame) {
+        script.apply(game, frame);
+        game.emulate_frame();
+        hashes.push_back(game.frame_hash);
+    }
+    return true;
+}
+
+bool record(const options& opts, const fs::path& rom, const std::vector<uint64_t>& hashes) {
+    fs::path path = opts.golden / (rom.filename().string() + ".golden");
+    std::ofstream golden(path);
+    if (!golden.is_open()) {
+        std::cerr << "Cannot write " << path << std::endl;
+        return false;
+    }
+
+    golden << "# frames " << opts.frames << " seed " << opts.seed << " memory " << opts.memory << "\n";
+    golden << std::hex;
+    for (uint64_t hash : hashes) {
+        golden << hash << "\n";
+    }
+    std::cout << rom.filename().string() << ": recorded " << hashes.size() << " frames" << std::endl;
+    return true;
+}
+
+bool verify(const options& opts, const fs::path& rom, const std::vector<uint64_t>& hashes) {
+    /*
+     * Compares each frame hash with the golden file and reports the first frame that differs
+     */
+
+    fs::path path = opts.golden / (rom.filename().string() + ".golden");
+    std::ifstream golden(path);
+    if (!golden.is_open()) {
+        std::cout << rom.filename().string() << ": FAIL, no golden file" << std::endl;
+        return false;
+    }
+
+    std::string line;
+    size_t frame = 0;
+    for (int number = 1; std::getline(golden, line); ++number) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        char* end = NULL;
+        errno = 0;
+        uint64_t expected = std::strtoull(line.c_str(), &end, 16);
+        if (errno != 0 || end == line.c_str() || *end != '\0') {
+            std::cout << rom.filename().string() << ": FAIL, " << path.string() << ":" << number
+                      << " is not a hex frame hash" << std::endl;
+            return false;
+        }
+        if (frame >= hashes.size()) {
+            break;
+        }
+        if (hashes[frame] != expected) {
+            std::cout << rom.filename().string() << ": FAIL at frame " << frame << std::hex
+                      << ", expected " << expected << " got " << hashes[frame] << std::dec << std::endl;
+            return false;
+        }
+        ++frame;
+    }
+
+    if (frame != hashes.size()) {
+        std::cout << rom.filename().string() << ": FAIL, golden file has " << frame << " frames" << std::endl;
+        return false;
+    }
+
+    std::cout << rom.filename().string() << ": ok" << std::endl;
+    return true;
+}
+
+int main(int argc, const char* argv[]) {
+    options opts;
+    std::vector<std::string> paths;
+
+    for (int arg = 1; arg < argc; ++arg) {
+        std::string name = argv[arg];
+        if (name == "--frames" && arg + 1 < argc) {
+            opts.frames = std::stoull(argv[++arg]);
+        }
+        else if (name == "--seed" && arg + 1 < argc) {
+            opts.seed = std::stoull(argv[++arg]);
+        }
+        else if (name == "--memory") {
+            opts.memory = true;
+        }
+        else if (name == "--record") {
+            opts.record = true;
+        }
+        else if (name == "--verify") {
+            opts.record = false;
+        }
+        else {
+            paths.push_back(name);
+        }
+    }
+
+    if (paths.size() != 2) {
+        std::cout << "Usage: ./chip-oct-headless [--frames N] [--seed N] [--memory] [--record|--verify] rom_or_dir golden_dir" << std::endl;
+        return 2;
+    }
+    opts.roms = paths[0];
+    opts.golden = paths[1];
+
+    std::vector<fs::path> roms;
+    if (fs::is_directory(opts.roms)) {
+        for (const auto& entry : fs::directory_iterator(opts.roms)) {
+            if (entry.is_regular_file()) {
+                roms.push_back(entry.path());
+            }
+        }
+        std::sort(roms.begin(), roms.end());
+    }
+    else {
+        roms.push_back(opts.roms);
+    }
+
+    int failed = 0;
+    std::vector<uint64_t> hashes;
+    for (const fs::path& rom : roms) {
+        bool passed = run_rom(opts, rom, hashes) && (opts.record ? record(opts, rom, hashes) : verify(opts, rom, hashes));
+        failed += !passed;
+    }
+
+    std::cout << roms.size() - failed << "/" << roms.size() << " ROMs passed" << std::endl;
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,112 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+
+#include "chip8.h"
+#include "session_host.h"
+
+
+namespace fs = std::filesystem;
+
+struct options {
+    int sessions = 1000;
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    unsigned long long ticks = 600;
+    std::vector<fs::path> roms;     // sessions take these in turn
+};
+
+
+unsigned short keys_at(int id, unsigned long long tick) {
+    // every session holds a key for 5 ticks out of 97, a different key and at a different time for each
+    unsigned long long phase = (tick + id) % 97;
+    return phase < 5 ? 1 << ((tick / 97 + id) % 16) : 0;
+}
+
+int main(int argc, const char* argv[]) {
+    /*
+     * Runs many sessions on a session_host with scripted key presses, and the same sessions again as
+     * separate machines; every session has to end in the same state as its machine
+     */
+
+    options opts;
+    for (int arg = 1; arg < argc; ++arg) {
+        std::string name = argv[arg];
+        if (name == "--sessions" && arg + 1 < argc) {
+            opts.sessions = std::max(1, std::atoi(argv[++arg]));
+        }
+        else if (name == "--threads" && arg + 1 < argc) {
+            opts.threads = std::max(1, std::atoi(argv[++arg]));
+        }
+        else if (name == "--ticks" && arg + 1 < argc) {
+            opts.ticks = std::stoull(argv[++arg]);
+        }
+        else {
+            opts.roms.push_back(name);
+        }
+    }
+
+    if (opts.roms.empty()) {
+        std::cout << "Usage: ./chip-oct-host [--sessions N] [--threads N] [--ticks N] rom..." << std::endl;
+        return 2;
+    }
+
+    session_host host(opts.threads);
+    std::vector<chip8> machines;
+    for (int id = 0; id < opts.sessions; ++id) {
+        chip8 game;
+        game.rng_seed = id + 1;
+        game.report_unknown = false;
+        game.initialize();
+        if (!game.load_rom(opts.roms[id % opts.roms.size()].c_str())) {
+            return 2;
+        }
+        host.add(game);
+        machines.push_back(std::move(game));
+    }
+
+    // the host, sending keys only when they change
+    int most_parked = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long long tick = 0; tick < opts.ticks; ++tick) {
+        for (int id = 0; id < opts.sessions; ++id) {
+            unsigned short keys = keys_at(id, tick);
+            if (tick == 0 || keys != keys_at(id, tick - 1)) {
+                host.send_keys(id, keys);
+            }
+        }
+        host.tick();
+        most_parked = std::max(most_parked, host.parked());
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // the separate machines
+    for (int id = 0; id < opts.sessions; ++id) {
+        chip8& game = machines[id];
+        for (unsigned long long tick = 0; tick < opts.ticks; ++tick) {
+            game.keys = keys_at(id, tick);
+            game.emulate_frame();
+        }
+    }
+
+    int differ = 0;
+    for (int id = 0; id < opts.sessions; ++id) {
+        std::vector<unsigned char> hosted, alone;
+        host.game(id).save_state(hosted);
+        machines[id].save_state(alone);
+        if (hosted != alone) {
+            if (differ == 0) {
+                std::cout << "session " << id << " differs from its machine" << std::endl;
+            }
+            ++differ;
+        }
+    }
+
+    std::cout << opts.sessions << " sessions, " << opts.ticks << " ticks in " << seconds << " s on "
+              << opts.threads << " threads, up to " << most_parked << " parked, "
+              << host.steals() << " stolen, " << differ << " differ" << std::endl;
+    return differ == 0 ? 0 : 1;
+}
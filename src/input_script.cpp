@@ -0,0 +1,71 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <cctype>
+
+#include "chip8.h"
+#include "input_script.h"
+
+
+bool input_script::load(const char* path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        std::cerr << "Input script not found: " << path << std::endl;
+        return false;
+    }
+
+    changes.clear();
+    next = 0;
+    current = 0;
+
+    std::string line;
+    for (int number = 1; std::getline(file, line); ++number) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        std::istringstream fields(line);
+        unsigned long long frame = 0;
+        std::string keys;
+        if (!(fields >> frame >> keys)) {
+            std::cerr << path << ":" << number << ": expected \"<frame> <keys>\"" << std::endl;
+            return false;
+        }
+
+        unsigned short mask = 0;
+        if (keys != "-") {
+            for (char key : keys) {
+                if (!std::isxdigit((unsigned char) key)) {
+                    std::cerr << path << ":" << number << ": keys must be hex digits or -" << std::endl;
+                    return false;
+                }
+                mask |= 1 << std::stoi(std::string(1, key), nullptr, 16);
+            }
+        }
+        changes.emplace_back(frame, mask);
+    }
+
+    std::stable_sort(changes.begin(), changes.end(),
+                     [](const auto& a, const auto& b) { return a.first < b.first; });
+    return true;
+}
+
+unsigned short input_script::keys_at(unsigned long long frame) {
+    if (next > 0 && changes[next - 1].first > frame) {   // went back in time, start over
+        next = 0;
+        current = 0;
+    }
+
+    while (next < changes.size() && changes[next].first <= frame) {
+        current = changes[next].second;
+        ++next;
+    }
+    return current;
+}
+
+void input_script::apply(chip8& game, unsigned long long frame) {
+    game.keys = keys_at(frame);
+}
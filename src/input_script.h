@@ -0,0 +1,24 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+
+class chip8;
+
+class input_script {
+    /*
+     * Scripted key presses for headless runs
+     * Each line is "<frame> <keys>": the hex keys held from that frame on, or "-" for none
+     * Lines starting with # are comments
+     */
+
+public:
+    bool load(const char* path);
+    unsigned short keys_at(unsigned long long frame);   // frames are expected in increasing order
+    void apply(chip8& game, unsigned long long frame);
+
+private:
+    std::vector<std::pair<unsigned long long, unsigned short>> changes;     // frame, key mask
+    size_t next = 0;
+    unsigned short current = 0;
+};
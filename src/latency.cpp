@@ -0,0 +1,113 @@
+#include <iostream>
+#include <algorithm>
+
+#include "chip8.h"
+#include "latency.h"
+
+
+static double milliseconds(latency_meter::clock::duration duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+latency_meter::latency_meter(const char* csv_path) : start(clock::now()) {
+    if (csv_path == NULL) {
+        return;
+    }
+    csv.open(csv_path, std::ios::out|std::ios::trunc);
+    if (!csv.is_open()) {
+        std::cerr << "Cannot write " << csv_path << std::endl;
+        return;
+    }
+    csv << "press_ms,observed_frame,observed_ms,presented_ms" << std::endl;
+}
+
+latency_meter::~latency_meter() {
+    if (samples != 0) {
+        std::cout << "Input latency: " << summary() << std::endl;
+    }
+}
+
+void latency_meter::press(uint64_t cycle, clock::time_point when) {
+    if (probe_id.load(std::memory_order_relaxed) != 0) {
+        if (when - pressed_at < std::chrono::seconds(1)) {     // still timing the last press
+            return;
+        }
+    }
+
+    pressed_at = when;
+    probe_cycle.store(cycle, std::memory_order_relaxed);
+    probe_id.store(next_id++, std::memory_order_release);
+}
+
+void latency_meter::frame_done(const chip8& game) {
+    /*
+     * Looks for the response to the press being timed in the frame just emulated
+     */
+
+    uint64_t id = probe_id.load(std::memory_order_acquire);
+    if (id != 0 && id != answered_id) {
+        if (id != watching) {
+            watching = id;
+            observed = false;
+        }
+
+        // the press was applied by the end of this frame and the game read the keys since
+        uint64_t frame_end = game.frame_count * CYCLES_PER_FRAME;
+        if (!observed && frame_end > probe_cycle.load(std::memory_order_relaxed) && game.keys_read) {
+            observed = true;
+            observed_frame.store(game.frame_count - 1, std::memory_order_relaxed);
+            observed_at.store(clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+        }
+
+        if (observed && game.frame_hash != last_hash) {
+            answered_id = id;
+        }
+    }
+    last_hash = game.frame_hash;
+}
+
+uint64_t latency_meter::answered() const {
+    return answered_id;
+}
+
+bool latency_meter::presented(uint64_t answered) {
+    uint64_t id = probe_id.load(std::memory_order_relaxed);
+    if (id == 0 || answered != id) {
+        return false;
+    }
+
+    clock::time_point now = clock::now();
+    clock::time_point observed_time{clock::duration(observed_at.load(std::memory_order_relaxed))};
+    double latency = milliseconds(now - pressed_at);
+    ++histogram[std::min((int) latency, BUCKETS - 1)];
+    ++samples;
+
+    if (csv.is_open()) {
+        csv << milliseconds(pressed_at - start) << ',' << observed_frame.load(std::memory_order_relaxed) << ','
+            << milliseconds(observed_time - pressed_at) << ',' << latency << std::endl;
+    }
+
+    probe_id.store(0, std::memory_order_relaxed);
+    return true;
+}
+
+int latency_meter::percentile(int percent) const {
+    // upper edge of the bucket holding the percentile, in ms
+    unsigned int rank = (samples * percent + 99) / 100;
+    unsigned int seen = 0;
+    for (int bucket = 0; bucket < BUCKETS; ++bucket) {
+        seen += histogram[bucket];
+        if (seen >= rank) {
+            return bucket + 1;
+        }
+    }
+    return BUCKETS;
+}
+
+std::string latency_meter::summary() const {
+    if (samples == 0) {
+        return "no presses timed";
+    }
+    return std::to_string(percentile(50)) + " ms median, " + std::to_string(percentile(95)) + " ms 95th percentile, "
+           + std::to_string(samples) + (samples == 1 ? " press" : " presses");
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+class chip8;
+
+class latency_meter {
+    /*
+     * Times key presses from the SDL event to the first changed frame on screen
+     * One press is timed at a time, in three steps:
+     * the main thread stamps the press, the emulation thread finds the frame that first read the keys
+     * after it (EX9E, EXA1 or FX0A) and then the first frame that differs from the one before,
+     * and the main thread notes when that frame was presented
+     * Presses that get no visible response within a second are dropped
+     */
+
+public:
+    using clock = std::chrono::steady_clock;
+
+    latency_meter(const char* csv_path);    // NULL keeps the histogram only
+    ~latency_meter();                       // prints the summary
+
+    // main thread
+    void press(uint64_t cycle, clock::time_point when);    // key press queued to apply at cycle
+    bool presented(uint64_t answered);      // after drawing a frame, true if a press was timed
+    std::string summary() const;            // median, 95th percentile and count, for the window title
+
+    // emulation thread
+    void frame_done(const chip8& game);     // after each emulated frame
+    uint64_t answered() const;              // last press whose response has been emulated, for the published frame
+
+private:
+    static const int BUCKETS = 256;     // 1 ms each, the last one holds everything slower
+
+    int percentile(int percent) const;
+
+    std::ofstream csv;
+    clock::time_point start;
+
+    // set by the main thread, the cycle before the id
+    std::atomic<uint64_t> probe_cycle{0};
+    std::atomic<uint64_t> probe_id{0};      // 0 while no press is timed
+    std::atomic<int64_t> observed_at{0};    // clock ticks, set by the emulation thread
+    std::atomic<unsigned long long> observed_frame{0};
+
+    // main thread
+    uint64_t next_id = 1;
+    clock::time_point pressed_at;
+    std::array<unsigned int, BUCKETS> histogram{};
+    unsigned int samples = 0;
+
+    // emulation thread
+    uint64_t watching = 0;          // id of the press being followed
+    bool observed = false;
+    uint64_t last_hash = 0;         // frame_hash of the previous frame
+    uint64_t answered_id = 0;
+};
@@ -0,0 +1,531 @@
+#include <algorithm>
+
+#include "lockstep.h"
+
+
+template <int LANES>
+lockstep<LANES>::lockstep(const chip8& prototype) {
+    machines.reserve(LANES);
+    for (int lane = 0; lane < LANES; ++lane) {
+        machines.push_back(prototype.clone());
+    }
+}
+
+template <int LANES>
+chip8& lockstep<LANES>::machine(int lane) {
+    // the caller may change the machine, so the lanes load it again before the next frame
+    store_machines();
+    return machines[lane];
+}
+
+template <int LANES>
+void lockstep<LANES>::set_keys(int lane, unsigned short held) {
+    machines[lane].keys = held;
+    keys[lane] = held;
+}
+
+template <int LANES>
+void lockstep<LANES>::store_machines() {
+    if (!in_lanes) {
+        return;
+    }
+    for (int lane = 0; lane < LANES; ++lane) {
+        store_registers(lane, true);
+    }
+    in_lanes = false;
+}
+
+template <int LANES>
+void lockstep<LANES>::load_registers(int lane, bool all) {
+    const chip8& game = machines[lane];
+    for (int reg = 0; reg < 16; ++reg) {
+        V[reg][lane] = game.V[reg];
+    }
+    pc[lane] = game.pc;
+    I[lane] = game.I;
+    opcode[lane] = game.opcode;
+    if (!all) {
+        return;
+    }
+
+    for (int level = 0; level < 16; ++level) {
+        stack[level][lane] = game.stack[level];
+    }
+    sp[lane] = game.sp;
+    delay_timer[lane] = game.delay_timer;
+    sound_timer[lane] = game.sound_timer;
+    keys[lane] = game.keys;
+}
+
+template <int LANES>
+void lockstep<LANES>::store_registers(int lane, bool all) {
+    chip8& game = machines[lane];
+    for (int reg = 0; reg < 16; ++reg) {
+        game.V[reg] = V[reg][lane];
+    }
+    game.pc = pc[lane];
+    game.I = I[lane];
+    game.opcode = opcode[lane];
+    if (!all) {
+        return;
+    }
+
+    for (int level = 0; level < 16; ++level) {
+        game.stack[level] = stack[level][lane];
+    }
+    game.sp = sp[lane];
+    game.delay_timer = delay_timer[lane];
+    game.sound_timer = sound_timer[lane];
+}
+
+template <int LANES>
+bool lockstep<LANES>::lanes_alone() {
+    /*
+     * Lanes spread over many addresses would mostly run alone, at more cost than plain chip8
+     * cycles, so such frames run each lane's chip8 on its own; so do the frames after one that ran
+     * mostly alone anyway, and MegaChip frames, whose opcodes all work on large per-lane buffers
+     * The lanes are checked again every frame, as inputs that made them diverge often make them meet again
+     */
+
+    if (backoff > 0) {
+        --backoff;
+        return true;
+    }
+
+    std::array<uint16_t, LANES> addresses;
+    for (int lane = 0; lane < LANES; ++lane) {
+        const chip8& game = machines[lane];
+        if (game.megachip || !game.ext_memory.empty()) {
+            return true;
+        }
+        addresses[lane] = in_lanes ? pc[lane] : game.pc;
+    }
+    std::sort(addresses.begin(), addresses.end());
+    return std::unique(addresses.begin(), addresses.end()) - addresses.begin() > DIVERGED;
+}
+
+template <int LANES>
+void lockstep<LANES>::emulate_frame() {
+    /*
+     * Registers stay in the lane arrays from frame to frame and are only copied back to the
+     * machines when a frame runs lane by lane or machine() is called
+     */
+
+    if (lanes_alone()) {
+        store_machines();
+        for (chip8& game : machines) {
+            for (int cycle = 0; cycle < CYCLES_PER_FRAME; ++cycle) {
+                game.emulate_cycle();
+            }
+            game.end_frame();
+        }
+        scalar_cycles += LANES * CYCLES_PER_FRAME;
+        return;
+    }
+
+    if (!in_lanes) {
+        for (int lane = 0; lane < LANES; ++lane) {
+            load_registers(lane, true);
+        }
+        in_lanes = true;
+    }
+
+    // code can be fetched once for all lanes where none of them has written since the shared image
+    shared_image = machines[0].rom_image != nullptr;
+    code_pages = 0;
+    keys_read = 0;
+    for (const chip8& game : machines) {
+        shared_image &= game.rom_image == machines[0].rom_image;
+        code_pages |= game.touched_pages | game.dirty_pages;
+    }
+
+    unsigned long long vectorized = vector_cycles;
+    for (int cycle = 0; cycle < CYCLES_PER_FRAME; ++cycle) {
+        step();
+    }
+    if ((vector_cycles - vectorized) * 2 < LANES * CYCLES_PER_FRAME) {
+        backoff = BACKOFF_FRAMES;
+    }
+
+    // only the timers of the registers take part in chip8::end_frame
+    for (int lane = 0; lane < LANES; ++lane) {
+        chip8& game = machines[lane];
+        game.delay_timer = delay_timer[lane];
+        game.sound_timer = sound_timer[lane];
+        game.keys_read |= (keys_read >> lane) & 1;
+        game.end_frame();
+        delay_timer[lane] = game.delay_timer;
+        sound_timer[lane] = game.sound_timer;
+    }
+}
+
+template <int LANES>
+void lockstep<LANES>::step() {
+    /*
+     * Runs one opcode on every lane, as chip8::emulate_cycle
+     * If all lanes are at one address in unwritten code, that is a single fetch; otherwise every
+     * lane fetches its own opcode and, unless all lanes agree, the lanes are sorted by address and
+     * opcode so each run of equal lanes forms a group that is run together
+     */
+
+    uint16_t lead = pc[0];
+    unsigned int spread = 0;
+    for (int lane = 0; lane < LANES; ++lane) {
+        spread |= pc[lane] ^ lead;
+    }
+
+    const chip8& first = machines[0];
+    uint64_t fetched_pages = (1ULL << (lead / MEMORY_PAGE_SIZE)) | (1ULL << ((lead + 1) / MEMORY_PAGE_SIZE));
+    if (spread == 0 && shared_image && lead < first.memory.size() - 1 && (code_pages & fetched_pages) == 0) {
+        run_group((first.memory[lead] << 8) | first.memory[lead + 1], ALL_LANES);
+        return;
+    }
+
+    // address, opcode and lane, so sorting groups equal lanes
+    std::array<uint64_t, LANES> key;
+    bool converged = true;
+    for (int lane = 0; lane < LANES; ++lane) {
+        const chip8& game = machines[lane];
+        unsigned short fetched = pc[lane] < game.memory.size() - 1 ? (game.memory[pc[lane]] << 8) | game.memory[pc[lane] + 1] : 0;
+        key[lane] = ((uint64_t) pc[lane] << 16 | fetched) << 8 | lane;
+        converged &= (key[lane] >> 8) == (key[0] >> 8);
+    }
+    if (!converged) {
+        std::sort(key.begin(), key.end());
+    }
+
+    for (int start = 0, end; start < LANES; start = end) {
+        uint64_t lead_key = key[start] >> 8;
+        uint32_t group = 0;
+        for (end = start; end < LANES && (key[end] >> 8) == lead_key; ++end) {
+            group |= 1u << (key[end] & 0xFF);
+        }
+
+        if ((lead_key >> 16) >= first.memory.size() - 1) {
+            emulate_alone(group);   // past the end of memory, as chip8::emulate_cycle does it
+            continue;
+        }
+        run_group(lead_key & 0xFFFF, group);
+    }
+}
+
+template <int LANES>
+void lockstep<LANES>::run_group(unsigned short op, uint32_t group) {
+    if (execute(op, group)) {
+        vector_cycles += __builtin_popcount(group);
+        return;
+    }
+    emulate_alone(group);
+}
+
+template <int LANES>
+void lockstep<LANES>::emulate_alone(uint32_t group) {
+    // stack edge cases, unknown opcodes and fetches past the end of memory, on each lane's chip8
+    for (uint32_t rest = group; rest != 0; rest &= rest - 1) {
+        int lane = __builtin_ctz(rest);
+        store_registers(lane, true);
+        machines[lane].emulate_cycle();
+        load_registers(lane, true);
+        code_pages |= machines[lane].dirty_pages;
+        ++scalar_cycles;
+    }
+}
+
+template <int LANES>
+bool lockstep<LANES>::execute(unsigned short op, uint32_t group) {
+    /*
+     * Runs op on the lanes whose bit is set in group, or returns false if they must run alone
+     * Each case follows the statement order of chip8::decode_opcode, so a VF write is seen by a
+     * following read of VX when X is F, exactly as on one machine
+     * With every lane in the group the loops run unmasked; a large group runs every lane and keeps
+     * the old value where the lane is not in it, which vectorizes; a small one visits only its own lanes
+     */
+
+    auto for_lanes = [&](auto&& body) {
+        if (group == ALL_LANES) {
+            for (int lane = 0; lane < LANES; ++lane) {
+                body(lane, true);
+            }
+        }
+        else if (__builtin_popcount(group) >= LANES / 4) {
+            lane_bytes mask;
+            for (int lane = 0; lane < LANES; ++lane) {
+                mask[lane] = (group >> lane) & 1;
+            }
+            for (int lane = 0; lane < LANES; ++lane) {
+                body(lane, mask[lane] != 0);
+            }
+        }
+        else {
+            for (uint32_t rest = group; rest != 0; rest &= rest - 1) {
+                body(__builtin_ctz(rest), true);
+            }
+        }
+    };
+
+    // opcodes that work on each lane's chip8 rather than on registers
+    auto each_lane = [&](auto&& body) {
+        for (uint32_t rest = group; rest != 0; rest &= rest - 1) {
+            body(__builtin_ctz(rest));
+        }
+    };
+
+    // a lane that switched to MegaChip mode during this frame draws and clears on its own
+    if (op == 0x00E0 || (op & 0xF000) == 0xD000) {
+        for (uint32_t rest = group; rest != 0; rest &= rest - 1) {
+            if (machines[__builtin_ctz(rest)].megachip) {
+                return false;
+            }
+        }
+    }
+
+    const int x = (op & 0x0F00) >> 8;
+    const int y = (op & 0x00F0) >> 4;
+    const uint8_t NN = op & 0x00FF;
+    const uint16_t NNN = op & 0x0FFF;
+    lane_bytes& VX = V[x];
+    const lane_bytes& VY = V[y];
+    lane_bytes& VF = V[0xF];
+
+    switch (op & 0xF000) {
+        case 0x0000:
+            if (op == 0x00E0) {
+                each_lane([&](int lane) {
+                    machines[lane].clear_display();
+                    machines[lane].draw_flag = true;
+                });
+                break;
+            }
+            if (op != 0x00EE) {
+                return false;
+            }
+            // stack levels differ between lanes so each lane is done on its own
+            for (uint32_t rest = group; rest != 0; rest &= rest - 1) {
+                if (sp[__builtin_ctz(rest)] == 0) {
+                    return false;
+                }
+            }
+            for_lanes([&](int lane, bool in) {
+                if (in) {
+                    --sp[lane];
+                    pc[lane] = stack[sp[lane]][lane];
+                }
+            });
+            break;
+
+        case 0x1000:
+            for_lanes([&](int lane, bool in) {
+                pc[lane] = in ? NNN - 2 : pc[lane];
+            });
+            break;
+
+        case 0x2000:
+            for (uint32_t rest = group; rest != 0; rest &= rest - 1) {
+                if (sp[__builtin_ctz(rest)] >= 16) {
+                    return false;
+                }
+            }
+            for_lanes([&](int lane, bool in) {
+                if (in) {
+                    stack[sp[lane]][lane] = pc[lane];
+                    ++sp[lane];
+                    pc[lane] = NNN - 2;
+                }
+            });
+            break;
+
+        case 0x3000:
+            for_lanes([&](int lane, bool in) {
+                pc[lane] += (in & (VX[lane] == NN)) ? 2 : 0;
+            });
+            break;
+
+        case 0x4000:
+            for_lanes([&](int lane, bool in) {
+                pc[lane] += (in & (VX[lane] != NN)) ? 2 : 0;
+            });
+            break;
+
+        case 0x5000:
+            if ((op & 0x000F) != 0) {
+                return false;
+            }
+            for_lanes([&](int lane, bool in) {
+                pc[lane] += (in & (VX[lane] == VY[lane])) ? 2 : 0;
+            });
+            break;
+
+        case 0x6000:
+            for_lanes([&](int lane, bool in) {
+                VX[lane] = in ? NN : VX[lane];
+            });
+            break;
+
+        case 0x7000:
+            for_lanes([&](int lane, bool in) {
+                VX[lane] = in ? (uint8_t) (VX[lane] + NN) : VX[lane];
+            });
+            break;
+
+        case 0x8000:
+            if ((op & 0x000F) > 0x7 && (op & 0x000F) != 0xE) {
+                return false;
+            }
+            for_lanes([&](int lane, bool in) {
+                uint8_t vx = VX[lane];
+                uint8_t vy = VY[lane];
+                uint8_t result = vx;
+                uint8_t flag = VF[lane];
+                switch (op & 0x000F) {
+                    case 0x0: result = vy; break;
+                    case 0x1: result = vx | vy; break;
+                    case 0x2: result = vx & vy; break;
+                    case 0x3: result = vx ^ vy; break;
+                    case 0x4: result = vx + vy; flag = (uint8_t) (vx + vy) < vx || (uint8_t) (vx + vy) < vy; break;
+                    case 0x5: flag = vx >= vy; result = (x == 0xF ? flag : vx) - vy; break;
+                    case 0x6: flag = vx & 0x01; result = (x == 0xF ? flag : vx) >> 1; break;
+                    case 0x7: flag = vy >= vx; result = vy - (x == 0xF ? flag : vx); break;
+                    case 0xE: flag = vx >> 7; result = (x == 0xF ? flag : vx) << 1; break;
+                }
+                VF[lane] = in ? flag : VF[lane];
+                VX[lane] = in ? result : VX[lane];
+            });
+            break;
+
+        case 0x9000:
+            if ((op & 0x000F) != 0) {
+                return false;
+            }
+            for_lanes([&](int lane, bool in) {
+                pc[lane] += (in & (VX[lane] != VY[lane])) ? 2 : 0;
+            });
+            break;
+
+        case 0xA000:
+            for_lanes([&](int lane, bool in) {
+                I[lane] = in ? NNN : I[lane];
+            });
+            break;
+
+        case 0xB000:
+            for_lanes([&](int lane, bool in) {
+                pc[lane] = in ? NNN + V[0][lane] - 2 : pc[lane];
+            });
+            break;
+
+        case 0xC000:
+            each_lane([&](int lane) {
+                VX[lane] = machines[lane].random_byte() & NN;
+            });
+            break;
+
+        case 0xD000:
+            each_lane([&](int lane) {
+                VF[lane] = machines[lane].draw_sprite(I[lane], VX[lane], VY[lane], op & 0x000F);
+            });
+            break;
+
+        case 0xE000:
+            if (NN != 0x9E && NN != 0xA1) {
+                return false;
+            }
+            keys_read |= group;
+            for_lanes([&](int lane, bool in) {
+                bool pressed = (keys[lane] >> (VX[lane] & 0xF)) & 1;
+                pc[lane] += (in & (pressed == (NN == 0x9E))) ? 2 : 0;
+            });
+            break;
+
+        case 0xF000:
+            switch (NN) {
+                case 0x07:
+                    for_lanes([&](int lane, bool in) {
+                        VX[lane] = in ? delay_timer[lane] : VX[lane];
+                    });
+                    break;
+
+                case 0x0A:
+                    keys_read |= group;
+                    each_lane([&](int lane) {
+                        if (keys[lane] == 0) {    // no key is pressed, run this instruction again
+                            pc[lane] -= 2;
+                        }
+                        else {
+                            VX[lane] = __builtin_ctz(keys[lane]);     // lowest key pressed
+                        }
+                    });
+                    break;
+
+                case 0x15:
+                    for_lanes([&](int lane, bool in) {
+                        delay_timer[lane] = in ? VX[lane] : delay_timer[lane];
+                    });
+                    break;
+
+                case 0x18:
+                    for_lanes([&](int lane, bool in) {
+                        sound_timer[lane] = in ? VX[lane] : sound_timer[lane];
+                    });
+                    break;
+
+                case 0x1E:
+                    for_lanes([&](int lane, bool in) {
+                        uint8_t vx = VX[lane];
+                        VF[lane] = in ? I[lane] + vx > 0xFFF : VF[lane];
+                        I[lane] = in ? I[lane] + vx : I[lane];
+                    });
+                    break;
+
+                case 0x29:
+                    for_lanes([&](int lane, bool in) {
+                        I[lane] = in ? VX[lane] * 5 : I[lane];
+                    });
+                    break;
+
+                case 0x33:
+                    each_lane([&](int lane) {
+                        chip8& game = machines[lane];
+                        uint8_t vx = VX[lane];
+                        game.write_memory(I[lane], vx / 100);
+                        game.write_memory(I[lane] + 1, (vx % 100) / 10);
+                        game.write_memory(I[lane] + 2, vx % 10);
+                        code_pages |= game.dirty_pages;
+                    });
+                    break;
+
+                case 0x55:
+                    each_lane([&](int lane) {
+                        chip8& game = machines[lane];
+                        for (int reg = 0; reg <= x; ++reg) {
+                            game.write_memory(I[lane] + reg, V[reg][lane]);
+                        }
+                        code_pages |= game.dirty_pages;
+                    });
+                    break;
+
+                case 0x65:
+                    each_lane([&](int lane) {
+                        const chip8& game = machines[lane];
+                        for (int reg = 0; reg <= x; ++reg) {
+                            V[reg][lane] = game.read_memory(I[lane] + reg);
+                        }
+                    });
+                    break;
+
+                default:
+                    return false;
+            }
+            break;
+    }
+
+    // the increment at the end of chip8::emulate_cycle
+    for_lanes([&](int lane, bool in) {
+        pc[lane] += in ? 2 : 0;
+        opcode[lane] = in ? op : opcode[lane];
+    });
+    return true;
+}
+
+template class lockstep<8>;
+template class lockstep<16>;
+template class lockstep<32>;
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <cstdint>
+
+#include "chip8.h"
+
+template <int LANES>
+class lockstep {
+    /*
+     * Runs LANES copies of a machine in lockstep, for workloads that step many instances of one ROM
+     * with different inputs
+     * The registers live in structure-of-arrays form, one array per register with a slot per lane;
+     * lanes at the same address fetching the same opcode run it together in loops over the lanes
+     * that the compiler turns into vector instructions, with a lane mask selecting the results
+     * When every lane is at the same address in code no lane has written to, the opcode is fetched
+     * once for all of them
+     * Opcodes that touch memory, the display or the random number generator run lane by lane
+     * straight on the lane's own chip8, which holds everything but the registers; only stack edge
+     * cases and unknown opcodes go through chip8::emulate_cycle, as do whole frames that start with
+     * the lanes spread over too many addresses or in MegaChip mode
+     * Registers stay in the lanes from frame to frame; machine() copies them back, so per-frame
+     * input goes through set_keys
+     * Build with -march for the target machine (make batch does), or the loops stay on SSE2
+     * Instantiated for 8, 16 and 32 lanes
+     */
+
+    static_assert(LANES >= 1 && LANES <= 32, "one to 32 lanes");
+
+public:
+    explicit lockstep(const chip8& prototype);  // every lane starts as a copy, without an input queue
+
+    chip8& machine(int lane);   // complete and up to date between frames, and may be changed there, memory through write_memory
+    void set_keys(int lane, unsigned short held);   // without the register copy machine() makes
+    void emulate_frame();       // one frame on every lane, as chip8::emulate_frame
+
+    unsigned long long vector_cycles = 0;   // lane cycles run together with other lanes
+    unsigned long long scalar_cycles = 0;   // lane cycles run alone on the lane's chip8
+
+private:
+    static const int DIVERGED = LANES / 4;     // more distinct addresses than this and a frame runs lane by lane
+    static const int BACKOFF_FRAMES = 8;        // frames run lane by lane after one that gained little
+    static const uint32_t ALL_LANES = LANES == 32 ? ~0u : (1u << LANES) - 1;
+
+    using lane_bytes = std::array<uint8_t, LANES>;
+    using lane_words = std::array<uint16_t, LANES>;
+
+    void load_registers(int lane, bool all);    // from the lane's chip8, all adds the stack, timers and keys
+    void store_registers(int lane, bool all);   // to the lane's chip8
+    void store_machines();              // every lane's registers to its chip8, when they live in the lanes
+    bool lanes_alone();                 // whether this frame runs each lane's chip8 on its own
+    void step();                        // one cycle on every lane
+    void run_group(unsigned short opcode, uint32_t group);
+    bool execute(unsigned short opcode, uint32_t group);     // group has a bit per lane, false if op must run alone
+    void emulate_alone(uint32_t group);
+
+    std::vector<chip8> machines;
+
+    // registers, [register][lane]
+    std::array<lane_bytes, 16> V;
+    std::array<lane_words, 16> stack;
+    lane_words pc;
+    std::array<uint32_t, LANES> I;
+    lane_bytes sp;
+    lane_words opcode;
+    lane_bytes delay_timer;
+    lane_bytes sound_timer;
+    lane_words keys;
+    uint32_t keys_read = 0;     // lanes that ran EX9E, EXA1 or FX0A this frame
+
+    uint64_t code_pages = 0;    // memory pages some lane may have changed since the shared ROM image
+    bool shared_image = false;  // every lane was loaded from the same rom_image
+
+    bool in_lanes = false;  // the registers above are newer than the machines'
+    int backoff = 0;    // frames left to run lane by lane
+};
@@ -1,64 +1,145 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <thread>
 #include <chrono>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
 
 #include <SDL2/SDL.h>
-#include <SDL2/SDL_mixer.h>
 
 #include "tinyfiledialogs/tinyfiledialogs.h"
 #include "chip8.h"
+#include "audio.h"
+#include "capture.h"
+#include "rewind.h"
+#include "movie.h"
+#include "triple_buffer.h"
+#include "latency.h"
 
 
-enum KEY_PRESSES {
-    KEY_PRESS_0,
-    KEY_PRESS_1,
-    KEY_PRESS_2,
-    KEY_PRESS_3,
-    KEY_PRESS_4,
-    KEY_PRESS_5,
-    KEY_PRESS_6,
-    KEY_PRESS_7,
-    KEY_PRESS_8,
-    KEY_PRESS_9,
-    KEY_PRESS_A,
-    KEY_PRESS_B,
-    KEY_PRESS_C,
-    KEY_PRESS_D,
-    KEY_PRESS_E,
-    KEY_PRESS_F,
+struct options {
+    const char* rom = NULL;         // ROM to open, or NULL for the "open ROM" dialogue box
+    const char* keymap = NULL;      // key mapping file, or NULL for the default layout
+    const char* capture = NULL;     // .y4m or .gif file to record gameplay to
+    int rewind_seconds = 60;        // history kept for rewinding, 0 turns rewinding off
+    const char* record_movie = NULL;    // movie file to record key presses to
+    const char* play_movie = NULL;      // movie file to play back
+    unsigned long long seek = 0;        // movie frame to start playing from
+    int run_ahead = 0;                  // frames to emulate ahead of the game for display
+    bool latency = false;               // time key presses to the screen, shown in the window title
+    const char* latency_csv = NULL;     // file to write each timed press to
+    bool audio_sync = false;            // pace emulation by the audio device instead of the system clock
 };
 
+struct scale_map {
+    int width = 0;                  // window size the map was built for
+    int height = 0;
+    int source_width = 0;           // display size the map was built for
+    int source_height = 0;
+    std::vector<int> columns;       // window column -> display column
+    std::vector<int> rows;          // window row -> offset of display row
+    SDL_Surface* shadow = NULL;     // ARGB surface used when the window surface is not 32-bit xRGB
+};
+
+struct video_frame {
+    bool megachip = false;
+    std::array<unsigned char, 64 * 32> display{};   // CHIP-8 pixels
+    std::vector<uint32_t> mega_frame;               // MegaChip pixels, ARGB
+    uint64_t answered = 0;                          // latency_meter press answered by this frame or an earlier one
+};
+
+struct shared_controls {
+    /*
+     * Set by the main thread, read by the emulation thread between frames
+     */
+
+    input_queue key_events;                 // CHIP-8 key changes, stamped with the cycle they apply at
+    std::atomic<uint64_t> frame_cycle{0};   // first cycle of the next frame to emulate
+    std::atomic<int64_t> frame_time{0};     // when the last frame was emulated, in steady clock ticks
+    std::atomic<bool> rewinding{false};
+    std::atomic<bool> reset{false};         // requests, cleared by the emulation thread once carried out
+    std::atomic<bool> save{false};
+    std::atomic<bool> load{false};
+    std::atomic<bool> quit{false};
+};
+
+using keymap = std::array<signed char, SDL_NUM_SCANCODES>;   // scancode -> CHIP-8 key, or -1
+
 
 void init_sdl();
 void init_window(SDL_Window*& window, SDL_Surface*& surface, int width, int height);
-void load_game(chip8& game, int argc, const char* argv[]);
-void game_loop(chip8& game, SDL_Window*& window, SDL_Surface*& base_surface, Mix_Chunk*& beep);
-void set_keys(chip8& game, SDL_Event& event);
-void controls(chip8& game, SDL_Event& event);
-void draw_graphics(chip8& game, SDL_Window*& window, SDL_Surface*& base_surface);
+options parse_options(int argc, const char* argv[]);
+void load_game(chip8& game, options& opts);
+void game_loop(chip8& game, const options& opts, const keymap& keys_of, SDL_Window*& window, SDL_Surface*& base_surface, audio_output& audio, frame_capture* capture, movie* film, latency_meter* latency);
+void emulation_loop(chip8& game, const options& opts, shared_controls& input, triple_buffer<video_frame>& frames, audio_output& audio, frame_capture* capture, movie* film, latency_meter* latency);
+bool load_keymap(const char* path, keymap& keys);
+void set_keys(unsigned short& keys, SDL_Event& event, const keymap& keys_of);
+void send_keys(shared_controls& input, unsigned short keys, unsigned short& sent, latency_meter* latency, Uint32 timestamp);
+void controls(shared_controls& input, SDL_Event& event);
+void run_commands(chip8& game, shared_controls& input, const options& opts);
+const chip8& run_ahead(const chip8& game, chip8& ahead, int frames);
+void update_scale_map(scale_map& scaler, SDL_Surface*& base_surface, int source_width, int source_height);
+void draw_graphics(const video_frame& frame, SDL_Window*& window, SDL_Surface*& base_surface, scale_map& scaler);
+void window_controls(SDL_Event& event, SDL_Window*& window, SDL_Surface*& base_surface, bool& redraw);
 
 
 int main(int argc, const char* argv[]) {
+    options opts = parse_options(argc, argv);
     init_sdl();
 
+    keymap keys_of;
+    if (!load_keymap(opts.keymap, keys_of)) {
+        exit(0);
+    }
+
     // data of display
     const int SCREEN_WIDTH = 1280;
     const int SCREEN_HEIGHT = 640;
     SDL_Window* main_window = NULL;
     SDL_Surface* base_surface = NULL;
     
-    // initialize window and beep object
+    // initialize window and sound
     init_window(main_window, base_surface, SCREEN_WIDTH, SCREEN_HEIGHT);
-    Mix_Chunk* beep = Mix_LoadWAV("../resources/beep.wav");    // for sound timer
+    audio_output audio(22050, 256, opts.audio_sync);
 
     // initialize and load game
     chip8 game;
-    load_game(game, argc, argv);
+    load_game(game, opts);
+
+    // static so the capture file is finished by exit()
+    static std::unique_ptr<frame_capture> capture;
+    if (opts.capture != NULL) {
+        capture = std::make_unique<frame_capture>(opts.capture);
+        if (!capture->is_open()) {
+            std::cout << "Cannot write " << opts.capture << std::endl;
+            exit(0);
+        }
+    }
+
+    // static so the movie is ended by exit()
+    static std::unique_ptr<movie> film;
+    if (opts.record_movie != NULL || opts.play_movie != NULL) {
+        film = std::make_unique<movie>();
+        bool opened = opts.play_movie != NULL ? film->load(opts.play_movie) && film->seek(game, opts.seek)
+                                              : film->record(opts.record_movie);
+        if (!opened) {
+            exit(0);
+        }
+    }
+
+    // static so the latency summary is printed by exit()
+    static std::unique_ptr<latency_meter> latency;
+    if (opts.latency) {
+        latency = std::make_unique<latency_meter>(opts.latency_csv);
+    }
 
     // begin game loop
-    game_loop(game, main_window, base_surface, beep);
+    game_loop(game, opts, keys_of, main_window, base_surface, audio, capture.get(), film.get(), latency.get());
     
     exit(0);
     return 0;
@@ -66,11 +147,10 @@ int main(int argc, const char* argv[]) {
 
 void init_sdl() {
     /* 
-     * Initializes SDL subsystems and mixer
+     * Initializes SDL subsystems
      */
 
     SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO); 
-    Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 4096);
 }
 
 void init_window(SDL_Window*& window, SDL_Surface*& surface, int width, int height) {
@@ -78,261 +158,498 @@ void init_window(SDL_Window*& window, SDL_Surface*& surface, int width, int heig
      * Initializes main window
      */
 
-    window = SDL_CreateWindow("CHIP-Oct", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, width, height, SDL_WINDOW_SHOWN);
+    window = SDL_CreateWindow("CHIP-Oct", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, width, height, SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
     surface = SDL_GetWindowSurface(window);
 }
 
-void load_game (chip8& game, int argc, const char* argv[]) {
-    /* 
-     * Checks for number of arguments and loads ROM 
-     * If only one argument exists (./chip-oct), display "open ROM" dialogue box   
-     * If two arguments exists (./chip-oct rom_name), open ROM directly
-     * If more than two arguments exist, quit program
+options parse_options(int argc, const char* argv[]) {
+    /*
+     * Reads --options and the ROM name
+     * If no ROM name is given, the "open ROM" dialogue box is displayed
+     * If the arguments are invalid, quit program
      */
-        
-    if (argc == 2) {
-        // open ROM directly in console
-        const char* rom = argv[1];
-        if(!game.load_rom(rom)) {
-            std::cout << "ROM not loaded" << std::endl;
+
+    options opts;
+    for (int arg = 1; arg < argc; ++arg) {
+        std::string name = argv[arg];
+
+        if (name == "--capture" && arg + 1 < argc) {
+            opts.capture = argv[++arg];
+        }
+        else if (name == "--record-movie" && arg + 1 < argc) {
+            opts.record_movie = argv[++arg];
+        }
+        else if (name == "--play-movie" && arg + 1 < argc) {
+            opts.play_movie = argv[++arg];
+        }
+        else if (name == "--seek" && arg + 1 < argc) {
+            opts.seek = std::stoull(argv[++arg]);
+        }
+        else if (name == "--keymap" && arg + 1 < argc) {
+            opts.keymap = argv[++arg];
+        }
+        else if (name == "--run-ahead" && arg + 1 < argc) {
+            opts.run_ahead = std::clamp(std::atoi(argv[++arg]), 0, 8);
+        }
+        else if (name == "--latency") {
+            opts.latency = true;
+        }
+        else if (name == "--latency-csv" && arg + 1 < argc) {
+            opts.latency = true;
+            opts.latency_csv = argv[++arg];
+        }
+        else if (name == "--audio-sync") {
+            opts.audio_sync = true;
+        }
+        else if (name == "--rewind" && arg + 1 < argc) {
+            opts.rewind_seconds = std::max(0, std::atoi(argv[++arg]));
+        }
+        else if (name.rfind("--", 0) != 0 && opts.rom == NULL) {
+            opts.rom = argv[arg];
+        }
+        else {  // unknown option or more than one ROM
+            std::cout << "Usage: ./chip-oct [--capture file.y4m|file.gif] [--keymap file] [--rewind seconds] [--audio-sync]"
+                      << " [--run-ahead frames] [--latency | --latency-csv file]"
+                      << " [--record-movie file | --play-movie file [--seek frame]] [rom_name]" << std::endl;
             exit(0);
         }
     }
-    else if (argc == 1) {
+    return opts;
+}
+
+void load_game (chip8& game, options& opts) {
+    /* 
+     * Loads the ROM given on the command line (./chip-oct rom_name)
+     * or the one picked in the "open ROM" dialogue box (./chip-oct)
+     */
+
+    const char* rom = opts.rom;
+    if (rom == NULL) {
         // display "open ROM" dialogue box
-        const char* rom = tinyfd_openFileDialog("Open ROM", ".", 0, NULL, NULL, 0);
-        if(!game.load_rom(rom)) {
-            std::cout << "ROM not loaded" << std::endl;
-            exit(0);
-        }
+        rom = tinyfd_openFileDialog("Open ROM", ".", 0, NULL, NULL, 0);
     }
-    else {  // invalid number of arguments
-        std::cout << "Usage: ./chip-oct rom_name" << std::endl;
+
+    if (rom == NULL || !game.load_rom(rom)) {
+        std::cout << "ROM not loaded" << std::endl;
         exit(0);
     }
+    opts.rom = rom;
 }
 
-void game_loop(chip8& game, SDL_Window*& window, SDL_Surface*& base_surface, Mix_Chunk*& beep) {
+void game_loop(chip8& game, const options& opts, const keymap& keys_of, SDL_Window*& window, SDL_Surface*& base_surface, audio_output& audio, frame_capture* capture, movie* film, latency_meter* latency) {
+    /*
+     * Runs the emulation on its own thread and presents the frames it publishes
+     * This thread only handles events and drawing, so a slow window update never delays emulation
+     */
+
     SDL_Event event;
+    scale_map scaler;               // window to display pixel mapping
+    shared_controls input;
+    unsigned short keys = 0;
+    unsigned short sent_keys = 0;   // last key mask queued for the emulation thread
+    bool redraw = false;            // window changed, draw the last frame again
+    const Uint8* held = SDL_GetKeyboardState(NULL);
 
-    while (true) {
-            game.emulate_cycle();
-        
-            while(SDL_PollEvent(&event)) {  // set key actions
-                set_keys(game, event);
-                controls(game, event);
+    static triple_buffer<video_frame> frames;   // static, too large for the stack
+    std::thread emulation(emulation_loop, std::ref(game), std::cref(opts), std::ref(input), std::ref(frames), std::ref(audio), capture, film, latency);
+
+    while (!input.quit) {
+        if (SDL_WaitEventTimeout(&event, 1)) {
+            do {    // set key actions
+                set_keys(keys, event, keys_of);
+                send_keys(input, keys, sent_keys, latency, event.type == SDL_KEYDOWN || event.type == SDL_KEYUP ? event.key.timestamp : SDL_GetTicks());
+                controls(input, event);
+                window_controls(event, window, base_surface, redraw);
+            } while (SDL_PollEvent(&event));
+
+            input.rewinding.store(opts.rewind_seconds > 0 && held[SDL_SCANCODE_BACKSPACE], std::memory_order_relaxed);
+        }
+
+        if (frames.update() || redraw) {
+            draw_graphics(frames.front(), window, base_surface, scaler);
+            redraw = false;
+            if (latency != NULL && latency->presented(frames.front().answered)) {
+                SDL_SetWindowTitle(window, ("CHIP-Oct - input latency " + latency->summary()).c_str());
             }
-            
-            game.decrement_timers();
+        }
+        send_keys(input, keys, sent_keys, latency, SDL_GetTicks());     // retry if the queue was full
+    }
+
+    emulation.join();
+}
+
+void emulation_loop(chip8& game, const options& opts, shared_controls& input, triple_buffer<video_frame>& frames, audio_output& audio, frame_capture* capture, movie* film, latency_meter* latency) {
+    /*
+     * Emulates 60 frames per second and publishes every frame that changed the display
+     * With --audio-sync the audio device's sample clock sets the pace instead of sleep_until
+     * With --run-ahead the frames shown are predicted from a copy of the game, see run_ahead
+     */
+
+    rewind_buffer rewinder(opts.rewind_seconds * 60);
+    chip8 ahead;    // copy of the game run ahead for display
+    uint64_t published_hash = 0;    // frame_hash of the last frame published
+    bool playing = opts.play_movie != NULL;
+    unsigned long long movie_frame = opts.seek;     // next frame of the movie to play
+    auto next_frame = std::chrono::steady_clock::now();
+
+    while (!input.quit) {
+        run_commands(game, input, opts);
+
+        if (playing && movie_frame >= film->frames()) {
+            std::cout << "Movie finished" << std::endl;
+            playing = false;
+        }
 
-            if (game.draw_flag) {
-                draw_graphics(game, window, base_surface);
-                game.draw_flag = false;
+        const chip8* shown = &game;     // machine whose display is presented
+        if (!playing && input.rewinding.load(std::memory_order_relaxed)) {    // step back while held
+            rewinder.rewind(game);
+        }
+        else {
+            if (playing) {      // movie keys replace the player's
+                film->play(game, movie_frame++);
+                input_event discarded;
+                while (input.key_events.try_pop(discarded)) {}
+            }
+            else {
+                game.input = &input.key_events;
+                if (film != NULL) {
+                    film->tap(game);
+                }
+            }
+            game.emulate_frame();
+            // a MegaChip machine would copy its 32 MiB of extended memory every frame, so it is shown as is
+            if (opts.run_ahead > 0 && !game.megachip && game.ext_memory.empty()) {
+                shown = &run_ahead(game, ahead, opts.run_ahead);
             }
+            if (latency != NULL) {
+                latency->frame_done(*shown);
+            }
+            if (opts.rewind_seconds > 0) {
+                rewinder.capture(game);
+            }
+        }
 
-            if (game.sound_timer > 0) {     // play sound
-                Mix_PlayChannel(-1, beep, 0);
+        if (capture != NULL) {
+            capture->tap(game);
+        }
+
+        // a prediction can be taken back without the new one drawing, so a changed hash publishes too
+        if (shown->draw_flag || shown->frame_hash != published_hash) {
+            published_hash = shown->frame_hash;
+            video_frame& frame = frames.back();
+            frame.megachip = shown->megachip;
+            frame.answered = latency != NULL ? latency->answered() : 0;
+            if (shown->megachip) {
+                frame.mega_frame = shown->mega_frame;
+            }
+            else {
+                frame.display = shown->display;
             }
+            frames.publish();
+            game.draw_flag = false;
+        }
+
+        // lets the main thread stamp key events relative to the next frame
+        input.frame_cycle.store(game.frame_count * CYCLES_PER_FRAME, std::memory_order_relaxed);
+        input.frame_time.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+
+        audio.set_tone(game.sound_timer > 0);     // play sound
+
+        if (game.sound_flag) {
+            audio.play_digitized(game);
+            game.sound_flag = false;
+        }
+
+        if (audio.clocked()) {      // run again as soon as the audio device needs more samples
+            audio.end_frame();
+            while (audio.frames_wanted() == 0 && !input.quit) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        else {
+            next_frame += std::chrono::microseconds(1000000 / 60);
+            std::this_thread::sleep_until(next_frame);  // 60 frames per second
+        }
+    }
+
+    if (film != NULL && !playing) {
+        film->flush(game);
+    }
+}
+
+const chip8& run_ahead(const chip8& game, chip8& ahead, int frames) {
+    /*
+     * Copies the game into ahead and emulates frames more frames on the copy with the keys held now,
+     * so a game that only acts on a key press a few frames after reading it shows the result at once
+     * The game itself is never touched, which restores it for free
+     * Assigning reuses ahead's buffers; a CHIP-8 machine copies in well under a microsecond
+     * Not used for MegaChip machines, whose extended memory is too large to copy every frame
+     */
+
+    ahead = game;
+    ahead.input = NULL;         // the queue belongs to game
+    ahead.log_input = false;
+    for (int frame = 0; frame < frames; ++frame) {
+        ahead.emulate_frame();
+    }
+    return ahead;
+}
+
+bool load_keymap(const char* path, keymap& keys) {
+    /*
+     * Fills the scancode table from a file of "<CHIP-8 key> <SDL scancode name>" lines,
+     * or with the default 1234/QWER/ASDF/ZXCV block if path is NULL
+     * Scancodes are key positions, so the layout is the same on any keyboard language
+     * A CHIP-8 key may be listed more than once; lines starting with # are comments
+     */
+
+    keys.fill(-1);
 
-            std::this_thread::sleep_for(std::chrono::microseconds(1200));   // to reduce emulation speed
+    if (path == NULL) {
+        const SDL_Scancode LAYOUT[16] = {
+            SDL_SCANCODE_X, SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3,     // 0 1 2 3
+            SDL_SCANCODE_Q, SDL_SCANCODE_W, SDL_SCANCODE_E, SDL_SCANCODE_A,     // 4 5 6 7
+            SDL_SCANCODE_S, SDL_SCANCODE_D, SDL_SCANCODE_Z, SDL_SCANCODE_C,     // 8 9 A B
+            SDL_SCANCODE_4, SDL_SCANCODE_R, SDL_SCANCODE_F, SDL_SCANCODE_V,     // C D E F
+        };
+        for (int key = 0; key < 16; ++key) {
+            keys[LAYOUT[key]] = key;
         }
+        return true;
+    }
+
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        std::cout << "Keymap not found: " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    for (int number = 1; std::getline(file, line); ++number) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        std::istringstream fields(line);
+        std::string key;
+        std::string name;   // may contain spaces, e.g. "Left Shift"
+        fields >> key;
+        std::getline(fields >> std::ws, name);
+        SDL_Scancode scancode = SDL_GetScancodeFromName(name.c_str());
+
+        if (key.size() != 1 || !std::isxdigit((unsigned char) key[0]) || scancode == SDL_SCANCODE_UNKNOWN) {
+            std::cout << path << ":" << number << ": expected \"<hex key> <key name>\"" << std::endl;
+            return false;
+        }
+        keys[scancode] = std::stoi(key, nullptr, 16);
+    }
+    return true;
 }
 
-void set_keys(chip8& game, SDL_Event& event) {
+void set_keys(unsigned short& keys, SDL_Event& event, const keymap& keys_of) {
     /*
      * Changes keyboard state according to currently pressed keys 
      */
 
-    // set key state to 1 if pressed
+    if (event.type != SDL_KEYDOWN && event.type != SDL_KEYUP) {
+        return;
+    }
+
+    int key = keys_of[event.key.keysym.scancode];
+    if (key < 0) {  // not a CHIP-8 key
+        return;
+    }
+
+    // set key state to 1 if pressed, 0 if released
     if (event.type == SDL_KEYDOWN) {
-        switch (event.key.keysym.sym) {
-            case SDLK_1: 
-                game.keyboard[KEY_PRESS_1] = 1;
-                break;
-                 
-            case SDLK_2: 
-                game.keyboard[KEY_PRESS_2] = 1;
-                break;
-                
-            case SDLK_3: 
-                game.keyboard[KEY_PRESS_3] = 1; 
-                break;
-                
-            case SDLK_4: 
-                game.keyboard[KEY_PRESS_C] = 1; 
-                break;
-                
-            case SDLK_q: 
-                game.keyboard[KEY_PRESS_4] = 1; 
-                break;
-                
-            case SDLK_w: 
-                game.keyboard[KEY_PRESS_5] = 1; 
-                break;
-                
-            case SDLK_e: 
-                game.keyboard[KEY_PRESS_6] = 1; 
-                break;
-                
-            case SDLK_r: 
-                game.keyboard[KEY_PRESS_D] = 1; 
-                break;
-                
-            case SDLK_a: 
-                game.keyboard[KEY_PRESS_7] = 1; 
-                break;
-                
-            case SDLK_s: 
-                game.keyboard[KEY_PRESS_8] = 1; 
-                break;
-                
-            case SDLK_d: 
-                game.keyboard[KEY_PRESS_9] = 1; 
-                break;
-                
-            case SDLK_f: 
-                game.keyboard[KEY_PRESS_E] = 1; 
-                break;
-                
-            case SDLK_z: 
-                game.keyboard[KEY_PRESS_A] = 1; 
-                break;
-                
-            case SDLK_x: 
-                game.keyboard[KEY_PRESS_0] = 1; 
-                break;
-                
-            case SDLK_c: 
-                game.keyboard[KEY_PRESS_B] = 1; 
-                break;
-                
-            case SDLK_v: 
-                game.keyboard[KEY_PRESS_F] = 1; 
-                break;
-                
-        }
-    }
-
-    // set key state to 0 if not pressed
-    if (event.type == SDL_KEYUP) {
-        switch (event.key.keysym.sym) {
-            case SDLK_1: 
-                game.keyboard[KEY_PRESS_1] = 0; 
-                break;
-                 
-            case SDLK_2: 
-                game.keyboard[KEY_PRESS_2] = 0;
-                break;
-                
-            case SDLK_3: 
-                game.keyboard[KEY_PRESS_3] = 0; 
-                break;
-                
-            case SDLK_4: 
-                game.keyboard[KEY_PRESS_C] = 0; 
-                break;
-                
-            case SDLK_q: 
-                game.keyboard[KEY_PRESS_4] = 0; 
-                break;
-                
-            case SDLK_w: 
-                game.keyboard[KEY_PRESS_5] = 0; 
-                break;
-                
-            case SDLK_e: 
-                game.keyboard[KEY_PRESS_6] = 0; 
-                break;
-                
-            case SDLK_r: 
-                game.keyboard[KEY_PRESS_D] = 0; 
-                break;
-                
-            case SDLK_a: 
-                game.keyboard[KEY_PRESS_7] = 0; 
-                break;
-                
-            case SDLK_s: 
-                game.keyboard[KEY_PRESS_8] = 0; 
-                break;
-                
-            case SDLK_d: 
-                game.keyboard[KEY_PRESS_9] = 0; 
-                break;
-                
-            case SDLK_f: 
-                game.keyboard[KEY_PRESS_E] = 0; 
-                break;
-                
-            case SDLK_z: 
-                game.keyboard[KEY_PRESS_A] = 0; 
-                break;
-                
-            case SDLK_x: 
-                game.keyboard[KEY_PRESS_0] = 0; 
-                break;
-                
-            case SDLK_c: 
-                game.keyboard[KEY_PRESS_B] = 0; 
-                break;
-                
-            case SDLK_v: 
-                game.keyboard[KEY_PRESS_F] = 0; 
-                break;      
-        }
+        keys |= 1 << key;
+    }
+    else {
+        keys &= ~(1 << key);
+    }
+}
+
+void send_keys(shared_controls& input, unsigned short keys, unsigned short& sent, latency_meter* latency, Uint32 timestamp) {
+    /*
+     * Queues a key change for the emulation thread if keys differ from the last one sent
+     * The change is stamped as far into the next frame as it is into the current frame period,
+     * so presses keep their spacing within a frame and apply at the same cycle in every replay
+     * timestamp is when SDL saw the event, in SDL ticks, so latency timing includes time spent queued
+     */
+
+    if (keys == sent) {
+        return;
+    }
+
+    int64_t elapsed = std::chrono::steady_clock::now().time_since_epoch().count() - input.frame_time.load(std::memory_order_relaxed);
+    int64_t period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::microseconds(1000000 / 60)).count();
+    int64_t cycle = std::clamp<int64_t>(elapsed * CYCLES_PER_FRAME / period, 0, CYCLES_PER_FRAME - 1);
+    uint64_t stamp = input.frame_cycle.load(std::memory_order_relaxed) + cycle;
+    if (!input.key_events.try_push({stamp, keys})) {
+        return;
+    }
+
+    if (latency != NULL && (keys & ~sent)) {     // a key went down
+        auto age = std::chrono::milliseconds(SDL_GetTicks() - timestamp);
+        latency->press(stamp, latency_meter::clock::now() - age);
     }
+    sent = keys;
 }
 
-void controls(chip8& game, SDL_Event& event) {
+void controls(shared_controls& input, SDL_Event& event) {
     /* 
      * Sets non-game controls
+     * They are carried out by the emulation thread before its next frame
      */
     if (event.type == SDL_QUIT) {
-        exit(0);
+        input.quit = true;
     }
 
     if (event.type == SDL_KEYDOWN) {
         if (event.key.keysym.sym == SDLK_ESCAPE) {
-            exit(0);
+            input.quit = true;
         }
         
         if (event.key.keysym.sym == SDLK_F1) {
-            game.reset();
-            game.draw_flag = true;
+            input.reset = true;
+        }
+
+        if (event.key.keysym.sym == SDLK_F5) {
+            input.save = true;
+        }
+
+        if (event.key.keysym.sym == SDLK_F9) {
+            input.load = true;
         }
     }
 }
 
-void draw_graphics(chip8& game, SDL_Window*& window, SDL_Surface*& base_surface) {
+void run_commands(chip8& game, shared_controls& input, const options& opts) {
+    /*
+     * Carries out the requests made by controls
+     * F5 saves the game to rom_name.state and F9 restores it
+     */
+
+    if (input.reset.exchange(false)) {
+        game.reset();
+        game.draw_flag = true;
+    }
+
+    if (input.save.exchange(false)) {
+        std::string state = std::string(opts.rom) + ".state";
+        if (game.save_state(state.c_str())) {
+            std::cout << "State saved to " << state << std::endl;
+        }
+    }
+
+    if (input.load.exchange(false)) {
+        std::string state = std::string(opts.rom) + ".state";
+        if (game.load_state(state.c_str())) {
+            std::cout << "State loaded from " << state << std::endl;
+        }
+    }
+}
+
+void update_scale_map(scale_map& scaler, SDL_Surface*& base_surface, int source_width, int source_height) {
+    /*
+     * Maps every window column and row to the display column and row it shows
+     * Only runs when the window or display size changes, so the divisions stay off the per-frame path
+     */
+
+    scaler.width = base_surface->w;
+    scaler.height = base_surface->h;
+    scaler.source_width = source_width;
+    scaler.source_height = source_height;
+
+    scaler.columns.resize(scaler.width);
+    for (int column = 0; column < scaler.width; ++column) {
+        scaler.columns[column] = column * source_width / scaler.width;
+    }
+
+    scaler.rows.resize(scaler.height);
+    for (int row = 0; row < scaler.height; ++row) {
+        scaler.rows[row] = (row * source_height / scaler.height) * source_width;
+    }
+
+    // window surfaces that are not 32-bit xRGB are drawn through an ARGB shadow surface
+    SDL_FreeSurface(scaler.shadow);
+    scaler.shadow = NULL;
+    Uint32 format = base_surface->format->format;
+    if (format != SDL_PIXELFORMAT_ARGB8888 && format != SDL_PIXELFORMAT_RGB888) {
+        scaler.shadow = SDL_CreateRGBSurfaceWithFormat(0, scaler.width, scaler.height, 32, SDL_PIXELFORMAT_ARGB8888);
+    }
+}
+
+void draw_graphics(const video_frame& frame, SDL_Window*& window, SDL_Surface*& base_surface, scale_map& scaler) {
     /* 
      * Copies the pixels in the display buffer and displays them on the corresponding positions on the screen
+     * Each window pixel looks up its display pixel through the scale map
+     * Window rows that show the same display row as the row above are copied whole
      */
 
-    // width and height of CHIP-8 platform
-    const int c8_width = 64;
-    const int c8_height = 32;
-    
-    SDL_Rect pixel;
-    pixel.w = base_surface->w / c8_width;
-    pixel.h = base_surface->h / c8_height;
-    std::array<unsigned char, c8_width * c8_height> screen = game.display;
-
-    // Draw each pixel if corresponding value in display buffer is 1
-    for (int row = 0; row < base_surface->h; row += pixel.h) {
-        for (int column = 0; column < base_surface->w; column += pixel.w) {
-            pixel.x = column;
-            pixel.y = row;
-            int pos = column/pixel.w + row/pixel.h * c8_width;
-            
-            if (screen[pos] == 1) { // pixel is drawn (white)
-                SDL_FillRect(base_surface, &pixel, SDL_MapRGB(base_surface->format, 0xFF, 0xFF, 0xFF));
+    // width and height of the current display
+    const int c8_width = frame.megachip ? MEGA_WIDTH : 64;
+    const int c8_height = frame.megachip ? MEGA_HEIGHT : 32;
+
+    if (scaler.width != base_surface->w || scaler.height != base_surface->h ||
+        scaler.source_width != c8_width || scaler.source_height != c8_height) {
+        update_scale_map(scaler, base_surface, c8_width, c8_height);
+    }
+
+    SDL_Surface* target = scaler.shadow != NULL ? scaler.shadow : base_surface;
+    SDL_LockSurface(target);
+
+    const int* columns = scaler.columns.data();
+    Uint8* pixels = (Uint8*) target->pixels;
+
+    // colors of an erased (black) and drawn (white) pixel
+    const Uint32 colors[2] = {
+        SDL_MapRGB(target->format, 0x00, 0x00, 0x00),
+        SDL_MapRGB(target->format, 0xFF, 0xFF, 0xFF),
+    };
+
+    for (int row = 0; row < scaler.height; ++row) {
+        Uint32* line = (Uint32*) (pixels + row * target->pitch);
+
+        if (row > 0 && scaler.rows[row] == scaler.rows[row - 1]) {   // same display row as above
+            std::memcpy(line, pixels + (row - 1) * target->pitch, scaler.width * sizeof(Uint32));
+            continue;
+        }
+
+        if (frame.megachip) {
+            const uint32_t* source = frame.mega_frame.data() + scaler.rows[row];
+            for (int column = 0; column < scaler.width; ++column) {
+                line[column] = source[columns[column]];
             }
-            else    // pixel is erased/not drawn (black)
-            {
-                SDL_FillRect(base_surface, &pixel, SDL_MapRGB(base_surface->format, 0x00, 0x00, 0x00));
+        }
+        else {
+            const unsigned char* source = frame.display.data() + scaler.rows[row];
+            for (int column = 0; column < scaler.width; ++column) {
+                line[column] = colors[source[columns[column]] & 1];
             }
-                        
         }
     }
+
+    SDL_UnlockSurface(target);
+    if (target != base_surface) {
+        SDL_BlitSurface(target, NULL, base_surface, NULL);
+    }
     SDL_UpdateWindowSurface(window);
-}
\ No newline at end of file
+}
+
+void window_controls(SDL_Event& event, SDL_Window*& window, SDL_Surface*& base_surface, bool& redraw) {
+    /*
+     * Handles resizing and F11 fullscreen toggling
+     * The window surface is replaced whenever the window size changes
+     */
+
+    if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_F11) {
+        bool fullscreen = SDL_GetWindowFlags(window) & SDL_WINDOW_FULLSCREEN_DESKTOP;
+        SDL_SetWindowFullscreen(window, fullscreen ? 0 : SDL_WINDOW_FULLSCREEN_DESKTOP);
+    }
+
+    if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+        base_surface = SDL_GetWindowSurface(window);
+        redraw = true;
+    }
+}
@@ -0,0 +1,214 @@
+#include <iostream>
+#include <memory>
+#include <algorithm>
+#include <cstring>
+
+#include "chip8.h"
+#include "movie.h"
+
+
+template <typename T>
+static void write_field(std::ofstream& file, T value) {
+    file.write((const char*) &value, sizeof(value));
+}
+
+template <typename T>
+static bool read_field(std::ifstream& file, T& value) {
+    return (bool) file.read((char*) &value, sizeof(value));
+}
+
+movie::~movie() {
+    if (file.is_open()) {
+        file.put('E');
+        write_field<uint64_t>(file, length);
+    }
+}
+
+bool movie::record(const char* path, int keyframe_interval) {
+    file.open(path, std::ios::out|std::ios::binary|std::ios::trunc);
+    if (!file.is_open()) {
+        std::cerr << "Cannot write movie " << path << std::endl;
+        return false;
+    }
+
+    this->keyframe_interval = keyframe_interval > 0 ? keyframe_interval : 1;
+    changes.clear();
+    keyframes.clear();
+    length = 0;
+
+    file.write(MOVIE_MAGIC, sizeof(MOVIE_MAGIC));
+    write_field<uint32_t>(file, MOVIE_VERSION);
+    write_field<uint32_t>(file, this->keyframe_interval);
+    return true;
+}
+
+void movie::flush(chip8& game) {
+    // the events were applied during the frame that started at last_frame_count
+    if (file.is_open() && length != 0) {
+        for (const input_event& event : game.input_log) {
+            store_change({length - 1, (unsigned char) (event.cycle - last_frame_count * CYCLES_PER_FRAME), event.keys});
+        }
+    }
+    game.input_log.clear();
+}
+
+void movie::store_change(const change& key_change) {
+    file.put('I');
+    write_field<uint64_t>(file, key_change.frame);
+    write_field<uint8_t>(file, key_change.cycle);
+    write_field<uint16_t>(file, key_change.keys);
+    changes.push_back(key_change);
+}
+
+void movie::tap(chip8& game) {
+    /*
+     * Stores the key changes made during the previous frame, the keys held at the start of
+     * this one if they changed in between, and a keyframe when one is due or when the game
+     * state jumped since the previous frame
+     */
+
+    if (!file.is_open()) {
+        return;
+    }
+
+    flush(game);
+    game.log_input = true;
+
+    bool jumped = length == 0 || game.frame_count != last_frame_count + 1;
+    if (jumped || since_keyframe >= keyframe_interval) {
+        game.save_state(state);
+        file.put('K');
+        write_field<uint64_t>(file, length);
+        write_field<uint32_t>(file, state.size());
+        file.write((const char*) state.data(), state.size());
+        since_keyframe = 0;
+    }
+
+    if (changes.empty() || changes.back().keys != game.keys) {
+        store_change({length, 0, game.keys});
+    }
+
+    last_frame_count = game.frame_count;
+    ++since_keyframe;
+    ++length;
+}
+
+bool movie::load(const char* path) {
+    std::ifstream in(path, std::ios::in|std::ios::binary);
+    if (!in.is_open()) {
+        std::cerr << "Movie not found: " << path << std::endl;
+        return false;
+    }
+
+    char magic[sizeof(MOVIE_MAGIC)];
+    uint32_t version = 0;
+    if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, MOVIE_MAGIC, sizeof(magic)) != 0
+            || !read_field(in, version) || version != MOVIE_VERSION || !read_field(in, keyframe_interval)) {
+        std::cerr << path << " is not a movie of this version" << std::endl;
+        return false;
+    }
+
+    changes.clear();
+    keyframes.clear();
+    length = 0;
+
+    bool ended = false;
+    char tag;
+    while (!ended && in.get(tag)) {
+        uint64_t frame = 0;
+        if (!read_field(in, frame)) {
+            break;
+        }
+
+        if (tag == 'I') {
+            uint8_t cycle = 0;
+            uint16_t keys = 0;
+            if (!read_field(in, cycle) || !read_field(in, keys) || cycle >= CYCLES_PER_FRAME) {
+                break;
+            }
+            changes.push_back({frame, cycle, keys});
+        }
+        else if (tag == 'K') {
+            uint32_t size = 0;
+            if (!read_field(in, size)) {
+                break;
+            }
+            keyframe key{frame, std::vector<unsigned char>(size)};
+            if (!in.read((char*) key.state.data(), size)) {
+                break;
+            }
+            keyframes.push_back(std::move(key));
+        }
+        else if (tag == 'E') {
+            ended = true;
+        }
+        else {
+            break;
+        }
+        length = std::max<unsigned long long>(length, ended ? frame : frame + 1);
+    }
+
+    if (keyframes.empty() || keyframes.front().frame != 0) {
+        std::cerr << path << " is damaged" << std::endl;
+        return false;
+    }
+    if (!ended) {
+        std::cout << path << " was cut short, playing " << length << " frames" << std::endl;
+    }
+    return true;
+}
+
+bool movie::seek(chip8& game, unsigned long long frame) {
+    /*
+     * Restores the last keyframe at or before frame, then replays the frames up to it
+     */
+
+    auto after = std::upper_bound(keyframes.begin(), keyframes.end(), frame,
+                                  [](unsigned long long frame, const keyframe& key) { return frame < key.frame; });
+    if (after == keyframes.begin()) {
+        return false;
+    }
+    const keyframe& key = *(after - 1);
+    if (!game.load_state(key.state.data(), key.state.size())) {
+        return false;
+    }
+
+    for (unsigned long long replay = key.frame; replay < frame; ++replay) {
+        play(game, replay);
+        game.emulate_frame();
+    }
+    return true;
+}
+
+void movie::play(chip8& game, unsigned long long frame) {
+    /*
+     * Sets the keys held at the start of frame and queues its mid-frame changes,
+     * and restores the keyframe stored for it so resets and state loads made while
+     * recording are played back too
+     */
+
+    auto key = std::lower_bound(keyframes.begin(), keyframes.end(), frame,
+                                [](const keyframe& key, unsigned long long frame) { return key.frame < frame; });
+    if (key != keyframes.end() && key->frame == frame) {
+        game.load_state(key->state.data(), key->state.size());
+    }
+
+    auto next = std::lower_bound(changes.begin(), changes.end(), frame,
+                                 [](const change& key_change, unsigned long long frame) { return key_change.frame < frame; });
+    game.keys = next == changes.begin() ? 0 : (next - 1)->keys;
+
+    uint64_t frame_start = game.frame_count * CYCLES_PER_FRAME;
+    for (; next != changes.end() && next->frame == frame; ++next) {
+        if (next->cycle == 0) {
+            game.keys = next->keys;
+        }
+        else {
+            replay.try_push({frame_start + next->cycle, next->keys});
+        }
+    }
+    game.input = &replay;
+}
+
+unsigned long long movie::frames() const {
+    return length;
+}
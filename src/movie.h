@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <vector>
+
+#include "chip8.h"
+
+/*
+ * Movie file layout, version 2
+ * An 8 byte magic, the version and the keyframe interval as uint32,
+ * then a stream of records in host byte order:
+ * 'I' uint64 frame, uint8 cycle, uint16 key mask - the keys held from that cycle of the frame on
+ * 'K' uint64 frame, uint32 size, save state - the state at the start of that frame
+ * 'E' uint64 frame - the length of the movie, missing if the recording was cut short
+ * Frames count from the start of the recording, the first record is always a keyframe
+ */
+
+const char MOVIE_MAGIC[8] = { 'C', 'H', 'I', 'P', 'M', 'O', 'V', 'I' };
+const uint32_t MOVIE_VERSION = 2;
+
+class movie {
+    /*
+     * Records every key change with the cycle it took effect at, plus a save state every
+     * keyframe_interval frames, and plays them back bit-exactly
+     * Changes made mid-frame are read from the game's input_log and replayed through an input queue
+     * Seeking restores the nearest keyframe before the target and replays at most keyframe_interval frames
+     * A reset, state load or rewind while recording is caught by the frame count jumping,
+     * and stored as an extra keyframe
+     */
+
+public:
+    ~movie();       // ends the recording
+
+    bool record(const char* path, int keyframe_interval = 600);
+    void tap(chip8& game);      // while recording, once per frame before emulate_frame
+    void flush(chip8& game);    // stores the key changes of the last emulated frame, before ending
+
+    bool load(const char* path);
+    bool seek(chip8& game, unsigned long long frame);  // state at the start of a movie frame
+    void play(chip8& game, unsigned long long frame);  // before emulate_frame on each frame of playback
+
+    unsigned long long frames() const;  // length of the loaded or recorded movie
+
+private:
+    struct change {
+        unsigned long long frame;
+        unsigned char cycle;        // within the frame
+        unsigned short keys;
+    };
+
+    struct keyframe {
+        unsigned long long frame;
+        std::vector<unsigned char> state;
+    };
+
+    void store_change(const change& key_change);
+
+    std::ofstream file;
+    uint32_t keyframe_interval = 600;
+    std::vector<change> changes;
+    std::vector<keyframe> keyframes;
+    unsigned long long length = 0;
+
+    // recording
+    unsigned long long last_frame_count = 0;    // game frame count at the previous tap
+    unsigned long long since_keyframe = 0;
+    std::vector<unsigned char> state;
+
+    // playback
+    input_queue replay;     // mid-frame changes of the frame being played
+};
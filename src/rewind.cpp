@@ -0,0 +1,234 @@
+#include <memory>
+#include <cstring>
+
+#include "chip8.h"
+#include "state.h"
+#include "rewind.h"
+
+
+static void put_varint(std::vector<unsigned char>& out, size_t value) {
+    while (value >= 0x80) {
+        out.push_back((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out.push_back(value);
+}
+
+static size_t get_varint(const unsigned char*& in) {
+    size_t value = 0;
+    for (int shift = 0; ; shift += 7) {
+        unsigned char byte = *in++;
+        value |= (size_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+}
+
+static size_t skip_clean_page(size_t pos, uint64_t clean_pages) {
+    /*
+     * Returns the end of the memory page pos is in if that page is clean, pos otherwise
+     */
+
+    const size_t MEMORY = offsetof(chip8_state, memory);
+    if (pos < MEMORY || pos >= MEMORY + 4096) {
+        return pos;
+    }
+
+    size_t page = (pos - MEMORY) / MEMORY_PAGE_SIZE;
+    if (!(clean_pages & (1ULL << page))) {
+        return pos;
+    }
+    return MEMORY + (page + 1) * MEMORY_PAGE_SIZE;
+}
+
+static void rle_encode(const unsigned char* data, const unsigned char* base, uint64_t clean_pages, size_t size, std::vector<unsigned char>& out) {
+    /*
+     * Run-length encodes data, or data XOR base if base is given
+     * Output is a list of (zero run length, literal length, literal bytes)
+     * Zero runs are found 8 bytes at a time, since most of a delta is zero,
+     * and memory pages in clean_pages are known to match base, so they are skipped without being read
+     */
+
+    out.clear();
+    size_t pos = 0;
+
+    while (pos < size) {
+        size_t zeros = pos;
+        while (zeros + 8 <= size) {
+            size_t skipped = skip_clean_page(zeros, clean_pages);
+            if (skipped != zeros) {
+                zeros = skipped;
+                continue;
+            }
+
+            uint64_t a, b = 0;
+            std::memcpy(&a, data + zeros, 8);
+            if (base != NULL) {
+                std::memcpy(&b, base + zeros, 8);
+            }
+            if ((a ^ b) != 0) {
+                break;
+            }
+            zeros += 8;
+        }
+        while (zeros < size && (data[zeros] ^ (base != NULL ? base[zeros] : 0)) == 0) {
+            ++zeros;
+        }
+
+        // literals run until the next stretch of at least 4 zero bytes
+        size_t literals = zeros;
+        size_t zero_count = 0;
+        while (literals + zero_count < size && zero_count < 4) {
+            unsigned char byte = data[literals + zero_count] ^ (base != NULL ? base[literals + zero_count] : 0);
+            if (byte == 0) {
+                ++zero_count;
+            }
+            else {
+                literals += zero_count + 1;
+                zero_count = 0;
+            }
+        }
+
+        put_varint(out, zeros - pos);
+        put_varint(out, literals - zeros);
+        for (size_t byte = zeros; byte < literals; ++byte) {
+            out.push_back(data[byte] ^ (base != NULL ? base[byte] : 0));
+        }
+        pos = literals;
+        if (literals == zeros) {    // only zeros were left
+            pos = size;
+        }
+    }
+}
+
+static void rle_decode(const std::vector<unsigned char>& in, const unsigned char* base, size_t size, std::vector<unsigned char>& out) {
+    /*
+     * Reverses rle_encode, XORing with base if it is given
+     */
+
+    out.resize(size);
+    const unsigned char* next = in.data();
+    const unsigned char* end = in.data() + in.size();
+    size_t pos = 0;
+
+    while (next < end) {
+        size_t zeros = get_varint(next);
+        for (size_t byte = pos; byte < pos + zeros; ++byte) {
+            out[byte] = base != NULL ? base[byte] : 0;
+        }
+        pos += zeros;
+
+        size_t literals = get_varint(next);
+        for (size_t byte = pos; byte < pos + literals; ++byte) {
+            out[byte] = *next++ ^ (base != NULL ? base[byte] : 0);
+        }
+        pos += literals;
+    }
+
+    for (; pos < size; ++pos) {     // trailing zeros
+        out[pos] = base != NULL ? base[pos] : 0;
+    }
+}
+
+rewind_buffer::rewind_buffer(int frames, int keyframe_interval)
+    : ring(frames > 1 ? frames : 2), keyframe_interval(keyframe_interval) {
+    // a keyframe must never be overwritten while frames after it are still being added
+    if (this->keyframe_interval > (int) ring.size() / 2) {
+        this->keyframe_interval = ring.size() / 2;
+    }
+}
+
+void rewind_buffer::clear() {
+    count = 0;
+    since_keyframe = 0;
+    keyframe.clear();
+    state.clear();      // the next capture saves the whole state
+}
+
+size_t rewind_buffer::frames() const {
+    return count;
+}
+
+size_t rewind_buffer::bytes() const {
+    size_t total = 0;
+    for (size_t age = 0; age < count; ++age) {
+        total += ring[(newest + ring.size() - age) % ring.size()].data.size();
+    }
+    return total;
+}
+
+void rewind_buffer::capture(const chip8& game) {
+    /*
+     * Stores the current frame, overwriting the oldest history when the ring is full
+     * Only the memory pages written since the last capture are serialized,
+     * and only those written since the keyframe are compared against it
+     * When the oldest keyframe is overwritten, the deltas that depend on it are dropped too
+     */
+
+    if (game.megachip || !game.ext_memory.empty()) {
+        clear();
+        return;
+    }
+
+    game.save_state(state, game.frame_pages);
+
+    if (count == ring.size()) {
+        --count;
+        while (count > 0 && !ring[(newest + ring.size() - count + 1) % ring.size()].keyframe) {
+            --count;
+        }
+    }
+
+    newest = (newest + 1) % ring.size();
+    ++count;
+    snapshot& slot = ring[newest];
+
+    slot.keyframe = count == 1 || since_keyframe >= keyframe_interval || keyframe.size() != state.size();
+    if (slot.keyframe) {
+        rle_encode(state.data(), NULL, 0, state.size(), slot.data);
+        keyframe = state;
+        keyframe_slot = newest;
+        since_keyframe = 0;
+        keyframe_pages = 0;
+    }
+    else {
+        keyframe_pages |= game.frame_pages;
+        rle_encode(state.data(), keyframe.data(), ~keyframe_pages, state.size(), slot.data);
+        ++since_keyframe;
+    }
+}
+
+bool rewind_buffer::rewind(chip8& game) {
+    /*
+     * Drops the newest frame and restores the one before it
+     */
+
+    if (count < 2) {
+        return false;
+    }
+
+    newest = (newest + ring.size() - 1) % ring.size();
+    --count;
+
+    // find and decode the keyframe of the new newest frame
+    size_t slot = newest;
+    since_keyframe = 0;
+    while (!ring[slot].keyframe) {
+        slot = (slot + ring.size() - 1) % ring.size();
+        ++since_keyframe;
+    }
+    if (slot != keyframe_slot || keyframe.empty()) {
+        rle_decode(ring[slot].data, NULL, state.size(), keyframe);
+        keyframe_slot = slot;
+    }
+
+    keyframe_pages = ALL_PAGES;     // not known for the restored frame
+    if (slot == newest) {
+        state = keyframe;
+    }
+    else {
+        rle_decode(ring[newest].data, keyframe.data(), keyframe.size(), state);
+    }
+    return game.load_state(state.data(), state.size());
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+class chip8;
+
+class rewind_buffer {
+    /*
+     * Ring buffer of per-frame save states for stepping backwards through play
+     * Every keyframe_interval frames a keyframe is stored run-length encoded,
+     * the frames in between as run-length encoded XOR deltas against their keyframe
+     * MegaChip games are not recorded, their states are too large
+     */
+
+public:
+    rewind_buffer(int frames, int keyframe_interval = 60);
+
+    void capture(const chip8& game);    // once per frame
+    bool rewind(chip8& game);           // steps back one frame, false when there is no history left
+    void clear();
+
+    size_t frames() const;      // frames of history held
+    size_t bytes() const;       // encoded size of the history
+
+private:
+    struct snapshot {
+        std::vector<unsigned char> data;    // encoded state
+        bool keyframe = false;
+    };
+
+    std::vector<snapshot> ring;
+    size_t newest = 0;                      // slot of the newest snapshot
+    size_t count = 0;                       // snapshots held
+    int keyframe_interval;
+    int since_keyframe = 0;                 // deltas stored since the newest keyframe
+
+    std::vector<unsigned char> state;       // current state, serialized
+    std::vector<unsigned char> keyframe;    // decoded keyframe the newest snapshot is based on
+    size_t keyframe_slot = 0;
+    uint64_t keyframe_pages = 0;            // memory pages written since the keyframe
+};
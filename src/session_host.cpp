@@ -0,0 +1,253 @@
+#include <iostream>
+#include <algorithm>
+
+#include "session_host.h"
+
+
+session_host::session_host(int threads) {
+    threads = std::max(threads, 1);
+    for (int index = 0; index < threads; ++index) {
+        workers.push_back(std::make_unique<worker>());
+    }
+    for (int index = 0; index < threads; ++index) {
+        workers[index]->thread = std::thread(&session_host::work, this, index);
+    }
+}
+
+session_host::~session_host() {
+    {
+        std::lock_guard<std::mutex> guard(tick_lock);
+        stopping = true;
+        ++generation;
+    }
+    tick_started.notify_all();
+    for (auto& w : workers) {
+        w->thread.join();
+    }
+}
+
+int session_host::add(const chip8& game) {
+    auto s = std::make_unique<session>();
+    s->game = game.clone();
+    s->game.input = &s->keys;
+
+    std::lock_guard<std::mutex> guard(add_lock);
+    int id = count.load(std::memory_order_relaxed);
+    if (id == CHUNK_SESSIONS * MAX_CHUNKS) {
+        std::cerr << "Session host is full" << std::endl;
+        return -1;
+    }
+    auto& chunk = chunks[id / CHUNK_SESSIONS];
+    if (!chunk) {
+        chunk = std::make_unique<std::unique_ptr<session>[]>(CHUNK_SESSIONS);
+    }
+    s->id = id;
+    s->home = id % workers.size();
+    chunk[id % CHUNK_SESSIONS] = std::move(s);
+    count.store(id + 1, std::memory_order_release);     // the session is complete before its id is
+    return id;
+}
+
+session_host::session& session_host::find(int id) const {
+    // ids are only handed out once their session is in the table, which never moves
+    return *chunks[id / CHUNK_SESSIONS][id % CHUNK_SESSIONS];
+}
+
+void session_host::send_keys(int id, unsigned short keys) {
+    /*
+     * Queues the keys as an event stamped at cycle 0, so they apply as soon as the session runs
+     * If the session is parked it is pushed on the woken list; a worker parking it at the same
+     * moment checks the queue again after publishing PARKED, so the press is never lost
+     */
+
+    session& s = find(id);
+    if (!s.keys.try_push({0, keys})) {
+        return;     // the session has 256 changes it has not run yet, it is not keeping up anyway
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    int expected = PARKED;
+    if (s.state.compare_exchange_strong(expected, WAKING)) {
+        session* head = woken.load(std::memory_order_relaxed);
+        do {
+            s.next_woken = head;
+        } while (!woken.compare_exchange_weak(head, &s, std::memory_order_release, std::memory_order_relaxed));
+    }
+}
+
+void session_host::on_frame(frame_callback callback) {
+    this->callback = std::move(callback);
+}
+
+void session_host::catch_up(session& s) {
+    /*
+     * Accounts the frames a parked session slept through
+     * A parked machine only repeats FX0A, so those frames just count down its timers
+     */
+
+    chip8& game = s.game;
+    unsigned long long slept = ticks - s.parked_tick;
+    if (slept == 0) {
+        return;
+    }
+    game.delay_timer -= std::min<unsigned long long>(game.delay_timer, slept);
+    game.sound_timer -= std::min<unsigned long long>(game.sound_timer, slept);
+    game.frame_count += slept;
+    game.frame_pages = 0;
+    s.parked_tick = ticks;
+}
+
+void session_host::wake_parked() {
+    // makes the sessions on the woken list runnable
+
+    session* s = woken.exchange(NULL, std::memory_order_acquire);
+    while (s != NULL) {
+        session* next = s->next_woken;
+        catch_up(*s);
+        s->state.store(RUNNABLE, std::memory_order_relaxed);
+        parked_count.fetch_sub(1, std::memory_order_relaxed);
+        s = next;
+    }
+}
+
+void session_host::tick() {
+    wake_parked();
+
+    std::vector<session*> runnable;
+    int added = count.load(std::memory_order_acquire);
+    for (int id = 0; id < added; ++id) {
+        session& s = find(id);
+        if (s.state.load(std::memory_order_relaxed) == RUNNABLE) {
+            runnable.push_back(&s);
+        }
+    }
+    ++ticks;
+    if (runnable.empty()) {
+        return;
+    }
+
+    // a worker still looking for work from the last tick may start on its own sessions at once,
+    // but steals only once it has woken up for this tick, like its victim
+    remaining.store(runnable.size(), std::memory_order_relaxed);
+    current.store(ticks, std::memory_order_relaxed);
+    for (session* s : runnable) {
+        worker& home = *workers[s->home];
+        std::lock_guard<std::mutex> guard(home.lock);
+        home.queue.push_back(s);
+    }
+
+    std::unique_lock<std::mutex> guard(tick_lock);
+    ++generation;
+    tick_started.notify_all();
+    tick_finished.wait(guard, [&] { return remaining.load(std::memory_order_acquire) == 0; });
+}
+
+session_host::session* session_host::take(int index) {
+    /*
+     * Own deque first, newest first; then the oldest of another worker's, starting with the next one
+     * Only workers awake for the current tick steal, and only from each other: stealing from one that
+     * has not woken yet would move its whole deque, and the cache it was kept for, to the first awake
+     */
+
+    worker& own = *workers[index];
+    {
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.queue.empty()) {
+            session* s = own.queue.back();
+            own.queue.pop_back();
+            return s;
+        }
+    }
+
+    unsigned long long tick = current.load(std::memory_order_relaxed);
+    if (own.running.load(std::memory_order_relaxed) != tick) {
+        return NULL;
+    }
+    for (size_t offset = 1; offset < workers.size(); ++offset) {
+        worker& victim = *workers[(index + offset) % workers.size()];
+        if (victim.running.load(std::memory_order_relaxed) != tick) {
+            continue;
+        }
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.queue.empty()) {
+            session* s = victim.queue.front();
+            victim.queue.pop_front();
+            steal_count.fetch_add(1, std::memory_order_relaxed);
+            return s;
+        }
+    }
+    return NULL;
+}
+
+void session_host::work(int index) {
+    unsigned long long seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> guard(tick_lock);
+            tick_started.wait(guard, [&] { return generation != seen; });
+            seen = generation;
+            if (stopping) {
+                return;
+            }
+        }
+        workers[index]->running.store(current.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+        while (session* s = take(index)) {
+            run(*s, index);
+            if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                std::lock_guard<std::mutex> guard(tick_lock);
+                tick_finished.notify_all();
+            }
+        }
+    }
+}
+
+bool session_host::waiting_for_key(const chip8& game) {
+    // FX0A runs again every cycle until a key is held
+    if (game.keys != 0 || game.pc >= game.memory.size() - 1) {
+        return false;
+    }
+    return (game.memory[game.pc] & 0xF0) == 0xF0 && game.memory[game.pc + 1] == 0x0A;
+}
+
+void session_host::run(session& s, int index) {
+    s.home = index;
+    s.game.emulate_frame();
+
+    if (callback && s.game.draw_flag) {
+        callback(s.id, s.game);
+    }
+    s.game.draw_flag = false;
+
+    if (waiting_for_key(s.game)) {
+        s.parked_tick = ticks;
+        s.state.store(PARKED, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        parked_count.fetch_add(1, std::memory_order_relaxed);
+        // a key sent before PARKED was visible did not wake the session, so look for it here
+        int expected = PARKED;
+        if (!s.keys.empty() && s.state.compare_exchange_strong(expected, RUNNABLE)) {
+            parked_count.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+int session_host::sessions() const {
+    return count.load(std::memory_order_acquire);
+}
+
+int session_host::parked() const {
+    return parked_count.load(std::memory_order_relaxed);
+}
+
+unsigned long long session_host::steals() const {
+    return steal_count.load(std::memory_order_relaxed);
+}
+
+const chip8& session_host::game(int id) {
+    session& s = find(id);
+    if (s.state.load(std::memory_order_relaxed) != RUNNABLE) {
+        catch_up(s);
+    }
+    return s.game;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "chip8.h"
+
+class session_host {
+    /*
+     * Runs many chip8 sessions in one process on a work-stealing pool of threads
+     * Each tick runs every runnable session for one frame: sessions are queued on the deque of the
+     * worker that last ran them, so their state is still in that core's cache, and a worker that runs
+     * out takes sessions from the front of the deque of another worker already running this tick;
+     * the deque of a worker that has not woken up yet is left to it
+     * A session that waits in FX0A with no keys held is parked and costs nothing until send_keys
+     * wakes it through a lock-free list; the frames it slept through are then accounted in one step
+     * The host does not pace itself, call tick 60 times a second for real time or in a loop for speed
+     */
+
+public:
+    using frame_callback = std::function<void(int id, const chip8& game)>;
+
+    explicit session_host(int threads = std::thread::hardware_concurrency());
+    ~session_host();
+
+    int add(const chip8& game);     // copies the machine into a new session, returns its id or -1 when full, from any thread
+    void send_keys(int id, unsigned short keys);    // keys held from the next frame on, one sending thread per session
+    void on_frame(frame_callback callback);         // called on the workers after each frame that drew, set before the first tick
+
+    void tick();    // runs every session that is not parked for one frame, returns when all have run
+
+    int sessions() const;
+    int parked() const;                 // sessions waiting for a key
+    unsigned long long steals() const;  // sessions run by a worker other than their last one
+
+    const chip8& game(int id);          // only between ticks, brings a parked session up to the current tick
+
+private:
+    enum session_state { RUNNABLE, PARKED, WAKING };
+
+    struct session {
+        chip8 game;
+        input_queue keys;
+        int id = 0;
+        int home = 0;                           // worker that last ran it
+        std::atomic<int> state{RUNNABLE};
+        unsigned long long parked_tick = 0;     // tick it was parked at
+        session* next_woken = NULL;             // link in the woken list
+    };
+
+    struct alignas(64) worker {
+        std::mutex lock;
+        std::deque<session*> queue;     // the owner takes from the back, thieves from the front
+        std::atomic<unsigned long long> running{0};     // tick the owner is taking sessions for
+        std::thread thread;
+    };
+
+    void work(int index);
+    session* take(int index);
+    void run(session& s, int index);
+    static bool waiting_for_key(const chip8& game);
+    void catch_up(session& s);
+    void wake_parked();
+    session& find(int id) const;
+
+    static const int CHUNK_SESSIONS = 1024;     // sessions per block of the session table
+    static const int MAX_CHUNKS = 4096;         // so at most 4M sessions
+
+    // session table: blocks are allocated as sessions are added and never move, and count publishes
+    // them, so looking a session up takes no lock while add() runs on another thread
+    std::mutex add_lock;                        // one add() at a time
+    std::array<std::unique_ptr<std::unique_ptr<session>[]>, MAX_CHUNKS> chunks;
+    std::atomic<int> count{0};
+    std::vector<std::unique_ptr<worker>> workers;
+    frame_callback callback;
+    unsigned long long ticks = 0;
+
+    // tick handoff
+    std::mutex tick_lock;
+    std::condition_variable tick_started;
+    std::condition_variable tick_finished;
+    unsigned long long generation = 0;      // incremented for each tick, and on shutdown
+    bool stopping = false;
+    std::atomic<int> remaining{0};          // sessions of this tick not yet run
+    std::atomic<unsigned long long> current{0};     // tick being handed out, workers steal only within it
+
+    std::atomic<session*> woken{NULL};      // parked sessions with new keys, a lock-free stack
+    std::atomic<int> parked_count{0};
+    std::atomic<unsigned long long> steal_count{0};
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+template <typename T, size_t N>
+class spsc_queue {
+    /*
+     * Lock-free ring buffer for exactly one producer thread and one consumer thread
+     * Slots are filled and read in place, so items are never copied through the queue
+     */
+
+    static_assert((N & (N - 1)) == 0, "queue size must be a power of two");
+
+public:
+    T* producer_slot() {
+        // next free slot, or NULL if the queue is full
+        size_t head_index = head.load(std::memory_order_relaxed);
+        if (head_index - tail.load(std::memory_order_acquire) == N) {
+            return NULL;
+        }
+        return &items[head_index & (N - 1)];
+    }
+
+    void push() {
+        // publishes the slot returned by producer_slot
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    bool try_push(const T& item) {
+        T* slot = producer_slot();
+        if (slot == NULL) {
+            return false;
+        }
+        *slot = item;
+        push();
+        return true;
+    }
+
+    T* consumer_slot() {
+        // oldest published slot, or NULL if the queue is empty
+        size_t tail_index = tail.load(std::memory_order_relaxed);
+        if (tail_index == head.load(std::memory_order_acquire)) {
+            return NULL;
+        }
+        return &items[tail_index & (N - 1)];
+    }
+
+    void pop() {
+        // releases the slot returned by consumer_slot
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    bool try_pop(T& item) {
+        T* slot = consumer_slot();
+        if (slot == NULL) {
+            return false;
+        }
+        item = *slot;
+        pop();
+        return true;
+    }
+
+    size_t size() const {
+        // items waiting, a snapshot that the other thread may change at any moment
+        size_t tail_index = tail.load(std::memory_order_acquire);  // tail first, so head is never behind it
+        return head.load(std::memory_order_acquire) - tail_index;
+    }
+
+    bool empty() const {
+        return tail.load(std::memory_order_acquire) == head.load(std::memory_order_acquire);
+    }
+
+private:
+    std::array<T, N> items;
+    alignas(64) std::atomic<size_t> head{0};    // written by the producer
+    alignas(64) std::atomic<size_t> tail{0};    // written by the consumer
+};
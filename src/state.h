@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Save state file layout, version 1
+ * A chip8_state block, followed by the extended memory if STATE_EXT_MEMORY is set,
+ * followed by a megachip_state block if STATE_MEGACHIP is set
+ * Every field has a fixed offset and host byte order, so restoring is a memcpy per field
+ */
+
+const char STATE_MAGIC[8] = { 'C', 'H', 'I', 'P', '-', 'O', 'C', 'T' };
+const uint32_t STATE_VERSION = 1;
+
+// flags
+const uint32_t STATE_EXT_MEMORY = 1 << 0;
+const uint32_t STATE_MEGACHIP = 1 << 1;
+
+struct chip8_state {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    unsigned char memory[4096];
+    unsigned char V[16];
+    uint16_t stack[16];
+    uint16_t pc;
+    uint16_t opcode;
+    uint32_t I;
+    uint8_t sp;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint8_t reserved;
+    unsigned char keyboard[16];
+    unsigned char display[64 * 32];
+    unsigned char padding[4];
+    uint64_t rng_state;
+    uint64_t frame_count;
+};
+
+struct megachip_state {
+    uint32_t palette[256];
+    uint32_t mega_back[256 * 192];
+    uint32_t mega_frame[256 * 192];
+    unsigned char mega_display[256 * 192];
+    uint16_t sprite_width;
+    uint16_t sprite_height;
+    uint8_t screen_alpha;
+    uint8_t blend_mode;
+    uint8_t collision_color;
+    uint8_t sound_loop;
+    uint32_t sound_address;
+    uint32_t sound_length;
+    uint16_t sound_rate;
+    uint8_t sound_playing;
+    uint8_t reserved;
+};
+
+static_assert(offsetof(chip8_state, memory) == 16, "save state layout changed");
+static_assert(offsetof(chip8_state, display) == 4188, "save state layout changed");
+static_assert(offsetof(chip8_state, rng_state) == 6240, "save state layout changed");
+static_assert(sizeof(chip8_state) == 6256, "save state layout changed");
+static_assert(sizeof(megachip_state) == 443412, "save state layout changed");
@@ -0,0 +1,120 @@
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+
+#include <unistd.h>
+#include <termios.h>
+
+#include "chip8.h"
+#include "terminal.h"
+
+
+// terminals only report key presses (and repeats), so a key is held this many frames after its last press
+const int KEY_HOLD_FRAMES = 8;
+
+// CHIP-8 key for each terminal character, same layout as the SDL frontend
+const char KEY_LAYOUT[16] = {
+    'x', '1', '2', '3',     // 0 - 3
+    'q', 'w', 'e', 'a',     // 4 - 7
+    's', 'd', 'z', 'c',     // 8 - B
+    '4', 'r', 'f', 'v',     // C - F
+};
+
+volatile std::sig_atomic_t running = 1;
+
+
+void stop(int) {
+    running = 0;
+}
+
+void raw_mode(termios& original) {
+    /*
+     * Stops the terminal from echoing and buffering input and makes reads non-blocking
+     * VMIN and VTIME of 0 do that without O_NONBLOCK, which would also apply to stdout when it
+     * shares the terminal's open file and stay set for the shell after exit
+     */
+
+    tcgetattr(STDIN_FILENO, &original);
+    termios raw = original;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+}
+
+void read_keys(chip8& game, std::array<int, 16>& held) {
+    /*
+     * Presses every key typed since the last frame and releases keys that were not repeated in time
+     * ESC on its own quits
+     */
+
+    char input[64];
+    ssize_t count = read(STDIN_FILENO, input, sizeof(input));
+
+    for (ssize_t i = 0; i < count; ++i) {
+        if (input[i] == 0x1B && i == count - 1) {
+            running = 0;
+        }
+
+        for (int key = 0; key < 16; ++key) {
+            if (input[i] == KEY_LAYOUT[key]) {
+                held[key] = KEY_HOLD_FRAMES;
+            }
+        }
+    }
+
+    game.keys = 0;
+    for (int key = 0; key < 16; ++key) {
+        game.keys |= (held[key] > 0) << key;
+        if (held[key] > 0) {
+            --held[key];
+        }
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    bool braille = argc == 3 && std::strcmp(argv[1], "--braille") == 0;
+    if (argc != 2 && !braille) {
+        std::cout << "Usage: ./chip-oct-term [--braille] rom_name" << std::endl;
+        return 0;
+    }
+
+    chip8 game;
+    if (!game.load_rom(argv[argc - 1])) {
+        std::cout << "ROM not loaded" << std::endl;
+        return 0;
+    }
+
+    std::signal(SIGINT, stop);
+    std::signal(SIGTERM, stop);
+
+    termios original;
+    raw_mode(original);
+
+    {
+        terminal_renderer renderer(braille);
+        std::array<int, 16> held = {};
+        auto next_frame = std::chrono::steady_clock::now();
+
+        while (running) {
+            read_keys(game, held);
+
+            game.emulate_frame();
+
+            // a frame skipped while the terminal was backlogged is sent once it drains
+            if (game.draw_flag || renderer.pending()) {
+                renderer.draw(game.display);
+                game.draw_flag = false;
+            }
+
+            next_frame += std::chrono::microseconds(1000000 / 60);
+            std::this_thread::sleep_until(next_frame);
+        }
+    }
+
+    tcsetattr(STDIN_FILENO, TCSANOW, &original);
+    return 0;
+}
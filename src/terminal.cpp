@@ -0,0 +1,154 @@
+#include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <cerrno>
+
+#include "terminal.h"
+
+
+// bytes waiting to be sent before a frame is skipped
+const int BACKLOG_LIMIT = 4096;
+
+// half blocks for (top, bottom) pixel pairs: none, top, bottom, both
+const char* HALF_BLOCKS[4] = { " ", "▀", "▄", "█" };
+
+// braille dot bit for each pixel of a 2x4 cell, indexed by [row][column]
+const unsigned char BRAILLE_DOTS[4][2] = {
+    { 0x01, 0x08 },
+    { 0x02, 0x10 },
+    { 0x04, 0x20 },
+    { 0x40, 0x80 },
+};
+
+
+terminal_renderer::terminal_renderer(bool braille) : braille(braille) {
+    columns = braille ? 64 / 2 : 64;
+    rows = braille ? 32 / 4 : 32 / 2;
+    cells.assign(columns * rows, 0);
+    dirty.assign(columns * rows, 0);
+
+    // alternate screen, hidden cursor, white on black, cleared
+    output = "\x1b[?1049h\x1b[?25l\x1b[97;40m\x1b[2J";
+    flush();
+}
+
+terminal_renderer::~terminal_renderer() {
+    output = "\x1b[0m\x1b[?25h\x1b[?1049l";
+    flush();
+}
+
+bool terminal_renderer::backlogged() {
+    /*
+     * Checks whether the terminal still has a lot of unsent output (slow link)
+     * Frames are skipped until it drains, since cells are compared to what was last sent
+     */
+
+    int pending = 0;
+    if (ioctl(STDOUT_FILENO, TIOCOUTQ, &pending) != 0) {
+        return false;   // not a tty, nothing to wait for
+    }
+    return pending > BACKLOG_LIMIT;
+}
+
+void terminal_renderer::append_glyph(unsigned char glyph) {
+    if (!braille) {
+        output += HALF_BLOCKS[glyph];
+        return;
+    }
+
+    // UTF-8 encoding of U+2800 + glyph
+    unsigned int code = 0x2800 + glyph;
+    output += (char) (0xE0 | (code >> 12));
+    output += (char) (0x80 | ((code >> 6) & 0x3F));
+    output += (char) (0x80 | (code & 0x3F));
+}
+
+void terminal_renderer::draw(const std::array<unsigned char, 64 * 32>& display) {
+    /*
+     * Builds the glyph of every cell from the display, marks cells that changed
+     * and writes only those, moving the cursor only when the changed cells are not adjacent
+     */
+
+    skipped = backlogged();
+    if (skipped) {
+        return;
+    }
+
+    int cell_width = braille ? 2 : 1;
+    int cell_height = braille ? 4 : 2;
+    bool changed = false;
+
+    for (int row = 0; row < rows; ++row) {
+        for (int column = 0; column < columns; ++column) {
+            unsigned char glyph = 0;
+            for (int y = 0; y < cell_height; ++y) {
+                const unsigned char* line = display.data() + (row * cell_height + y) * 64 + column * cell_width;
+                for (int x = 0; x < cell_width; ++x) {
+                    unsigned char bit = braille ? BRAILLE_DOTS[y][x] : (1 << y);
+                    glyph |= (line[x] & 1) ? bit : 0;
+                }
+            }
+
+            int cell = row * columns + column;
+            dirty[cell] = stale || glyph != cells[cell];
+            cells[cell] = glyph;
+            changed |= dirty[cell];
+        }
+    }
+
+    if (!changed) {
+        return;
+    }
+
+    // after a failed write the screen may hold part of an escape sequence, so start from a clear one
+    if (stale) {
+        output += "\x1b[2J";
+        stale = false;
+    }
+
+    int cursor = -1;    // cell the cursor is on, if known
+    for (int cell = 0; cell < columns * rows; ++cell) {
+        if (!dirty[cell]) {
+            continue;
+        }
+
+        if (cell != cursor) {
+            output += "\x1b[" + std::to_string(cell / columns + 1) + ";" + std::to_string(cell % columns + 1) + "H";
+        }
+        append_glyph(cells[cell]);
+        cursor = (cell % columns == columns - 1) ? -1 : cell + 1;
+    }
+
+    flush();
+}
+
+bool terminal_renderer::pending() const {
+    return skipped;
+}
+
+void terminal_renderer::flush() {
+    /*
+     * Sends the whole frame with a single write, retrying if it is cut short
+     * If stdout is non-blocking and full, waits until it can take more
+     * A frame that still cannot be sent marks every cell stale, so the next draw resends all of them
+     */
+
+    size_t written = 0;
+    while (written < output.size()) {
+        ssize_t result = write(STDOUT_FILENO, output.data() + written, output.size() - written);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            pollfd out = { STDOUT_FILENO, POLLOUT, 0 };
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && poll(&out, 1, -1) > 0) {
+                continue;
+            }
+            stale = true;
+            break;
+        }
+        written += result;
+    }
+    output.clear();
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <vector>
+
+class terminal_renderer {
+public:
+    terminal_renderer(bool braille);
+    ~terminal_renderer();   // restores the terminal
+
+    void draw(const std::array<unsigned char, 64 * 32>& display);
+    bool pending() const;   // the last draw was skipped, call draw again even if the display did not change
+
+private:
+    bool braille;                       // 2x4 braille cells instead of 1x2 half blocks
+    int columns;                        // size of the display in terminal cells
+    int rows;
+    std::vector<unsigned char> cells;   // glyph currently shown in each cell
+    std::vector<unsigned char> dirty;   // cells whose glyph changed since the last write
+    std::string output;                 // escape sequences of one frame
+    bool skipped = false;               // a frame was not sent because of the backlog
+    bool stale = false;                 // a write failed, cells no longer match the screen
+
+    bool backlogged();
+    void append_glyph(unsigned char glyph);
+    void flush();
+};
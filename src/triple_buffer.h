@@ -0,0 +1,48 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+
+template <typename T>
+class triple_buffer {
+    /*
+     * Lock-free handoff of the newest value from exactly one writer thread to one reader thread
+     * The writer fills the back slot and swaps it with the middle one; the reader swaps the middle
+     * slot with the front one when a fresh value is waiting
+     * Neither side ever waits, and values the reader missed are simply overwritten
+     */
+
+public:
+    T& back() {
+        // slot to fill, owned by the writer
+        return slots[back_index];
+    }
+
+    void publish() {
+        // makes the back slot the newest value
+        back_index = middle.exchange(back_index | FRESH, std::memory_order_acq_rel) & INDEX;
+    }
+
+    bool update() {
+        // moves the newest value to the front slot, false if nothing was published since the last update
+        if (!(middle.load(std::memory_order_relaxed) & FRESH)) {
+            return false;
+        }
+        front_index = middle.exchange(front_index, std::memory_order_acq_rel) & INDEX;
+        return true;
+    }
+
+    const T& front() const {
+        // newest value seen by update, owned by the reader
+        return slots[front_index];
+    }
+
+private:
+    static const int INDEX = 3;     // slot index bits of middle
+    static const int FRESH = 4;     // set when middle holds a value the reader has not taken
+
+    std::array<T, 3> slots;
+    alignas(64) std::atomic<int> middle{1};
+    alignas(64) int back_index = 0;     // writer only
+    alignas(64) int front_index = 2;    // reader only
+};
@@ -0,0 +1,293 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <algorithm>
+
+#include "vec_env.h"
+#include "hash.h"
+
+
+long long memory_value::read(const chip8& game) const {
+    switch (kind) {
+        case BYTE:
+            return game.read_memory(address);
+
+        case WORD:
+            return (game.read_memory(address) << 8) | game.read_memory(address + 1);
+
+        case BCD: {
+            long long number = 0;
+            for (int digit = 0; digit < digits; ++digit) {
+                number = number * 10 + game.read_memory(address + digit);
+            }
+            return number;
+        }
+
+        case REGISTER:
+            return game.V[address & 0xF];
+    }
+    return 0;
+}
+
+bool env_spec::condition::holds(const chip8& game) const {
+    long long current = value.read(game);
+    switch (op) {
+        case EQUAL: return current == number;
+        case NOT_EQUAL: return current != number;
+        case LESS: return current < number;
+        case LESS_EQUAL: return current <= number;
+        case GREATER: return current > number;
+        case GREATER_EQUAL: return current >= number;
+    }
+    return false;
+}
+
+static bool parse_number(const std::string& text, long long& number) {
+    // decimal, or hex with 0x
+    try {
+        size_t used = 0;
+        number = std::stoll(text, &used, 0);
+        return used == text.size();
+    }
+    catch (const std::exception&) {
+        return false;
+    }
+}
+
+static bool parse_value(std::istringstream& fields, memory_value& value) {
+    // "byte ADDR", "word ADDR", "bcd ADDR N" or "reg X"
+    std::string kind, address;
+    if (!(fields >> kind >> address)) {
+        return false;
+    }
+
+    long long number = 0;
+    if (kind == "reg") {
+        value.kind = memory_value::REGISTER;
+        if (!parse_number(address, number) && !parse_number("0x" + address, number)) {     // reg F as well as reg 15
+            return false;
+        }
+        value.address = number;
+        return number >= 0 && number < 16;
+    }
+
+    if (!parse_number(address, number) || number < 0 || number >= MEGA_MEMORY_SIZE - 8) {
+        return false;
+    }
+    value.address = number;
+
+    if (kind == "byte") {
+        value.kind = memory_value::BYTE;
+    }
+    else if (kind == "word") {
+        value.kind = memory_value::WORD;
+    }
+    else if (kind == "bcd") {
+        std::string digits;
+        value.kind = memory_value::BCD;
+        if (!(fields >> digits) || !parse_number(digits, number) || number < 1 || number > 8) {
+            return false;
+        }
+        value.digits = number;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+bool env_spec::load(const char* path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        std::cerr << "Environment spec not found: " << path << std::endl;
+        return false;
+    }
+
+    *this = env_spec();
+
+    std::string line;
+    for (int number = 1; std::getline(file, line); ++number) {
+        std::istringstream fields(line);
+        std::string setting;
+        if (!(fields >> setting) || setting[0] == '#') {
+            continue;
+        }
+
+        bool valid = false;
+        if (setting == "score") {
+            valid = parse_value(fields, score);
+            has_score = true;
+        }
+        else if (setting == "done") {
+            static const char* ops[] = {"==", "!=", "<", "<=", ">", ">="};
+            condition check;
+            std::string op, limit;
+            valid = parse_value(fields, check.value) && (fields >> op >> limit) && parse_number(limit, check.number);
+            auto found = std::find(std::begin(ops), std::end(ops), op);
+            valid &= found != std::end(ops);
+            check.op = (decltype(check.op)) (found - std::begin(ops));
+            done.push_back(check);
+        }
+        else if (setting == "frames_per_step") {
+            long long frames = 0;
+            std::string text;
+            valid = (fields >> text) && parse_number(text, frames) && frames >= 1;
+            frames_per_step = frames;
+        }
+        else if (setting == "max_frames") {
+            long long frames = 0;
+            std::string text;
+            valid = (fields >> text) && parse_number(text, frames) && frames >= 0;
+            max_frames = frames;
+        }
+
+        std::string extra;
+        if (!valid || fields >> extra) {
+            std::cerr << path << ":" << number << ": cannot read \"" << line << "\"" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+vec_env::vec_env(const chip8& prototype, const env_spec& spec, int count, int threads)
+    : spec(spec) {
+    envs.resize(std::max(count, 0));
+    for (env& e : envs) {
+        e.game = prototype.clone();
+        e.game.report_unknown = false;  // printing would serialize the threads
+    }
+
+    // the calling thread runs slice 0, each worker one of the others
+    slices = std::max(1, std::min<int>(threads, envs.size()));
+    for (int slice = 1; slice < slices; ++slice) {
+        workers.emplace_back(&vec_env::work, this, slice);
+    }
+}
+
+vec_env::~vec_env() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+        ++generation;
+    }
+    started.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+int vec_env::size() const {
+    return envs.size();
+}
+
+const chip8& vec_env::game(int index) const {
+    return envs[index].game;
+}
+
+void vec_env::restart(env& e) {
+    /*
+     * Starts the next episode: the first from the reset() seed, later ones from seeds derived from it
+     * A seed of 0 would make chip8 seed from the clock, so it becomes a fixed one instead
+     * chip8::reset only copies back the memory pages the last episode wrote (touched_pages)
+     */
+
+    e.game.rng_seed = e.episode == 0 ? e.seed : mix64(e.seed + e.episode);
+    if (e.game.rng_seed == 0) {
+        e.game.rng_seed = 0x9E3779B97F4A7C15ULL;
+    }
+    e.game.reset();
+    ++e.episode;
+    e.episode_frames = 0;
+    e.score = spec.has_score ? spec.score.read(e.game) : 0;
+}
+
+void vec_env::run_slice(int slice) {
+    size_t begin = envs.size() * slice / slices;
+    size_t end = envs.size() * (slice + 1) / slices;
+
+    for (size_t index = begin; index < end; ++index) {
+        env& e = envs[index];
+        uint64_t* observation = observations + index * OBSERVATION_WORDS;
+
+        if (job == RESET) {
+            e.seed = seeds[index];
+            e.episode = 0;
+            restart(e);
+            e.game.pack_display(observation);
+            continue;
+        }
+
+        e.game.keys = actions[index];
+        for (int frame = 0; frame < spec.frames_per_step; ++frame) {
+            e.game.emulate_frame();
+        }
+        e.episode_frames += spec.frames_per_step;
+
+        long long score = spec.has_score ? spec.score.read(e.game) : 0;
+        rewards[index] = score - e.score;
+        e.score = score;
+
+        bool over = spec.max_frames != 0 && e.episode_frames >= spec.max_frames;
+        for (const env_spec::condition& check : spec.done) {
+            over |= check.holds(e.game);
+        }
+        dones[index] = over;
+        if (over) {
+            restart(e);
+        }
+        e.game.pack_display(observation);
+    }
+}
+
+void vec_env::work(int slice) {
+    unsigned long long seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            started.wait(guard, [&] { return generation != seen; });
+            seen = generation;
+            if (stopping) {
+                return;
+            }
+        }
+
+        run_slice(slice);
+        if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            std::lock_guard<std::mutex> guard(lock);
+            finished.notify_all();
+        }
+    }
+}
+
+void vec_env::run_job() {
+    // hands the call's arguments to the workers, runs slice 0 and waits for the rest
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        remaining.store(slices - 1, std::memory_order_relaxed);
+        ++generation;
+    }
+    started.notify_all();
+    run_slice(0);
+
+    std::unique_lock<std::mutex> guard(lock);
+    finished.wait(guard, [&] { return remaining.load(std::memory_order_acquire) == 0; });
+}
+
+void vec_env::reset(const uint64_t* seeds, uint64_t* observations) {
+    job = RESET;
+    this->seeds = seeds;
+    this->observations = observations;
+    run_job();
+}
+
+void vec_env::step(const unsigned short* actions, uint64_t* observations, float* rewards, unsigned char* dones) {
+    job = STEP;
+    this->actions = actions;
+    this->observations = observations;
+    this->rewards = rewards;
+    this->dones = dones;
+    run_job();
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstdint>
+
+#include "chip8.h"
+
+struct memory_value {
+    /*
+     * A number read from the machine at the end of a step:
+     *   byte ADDR      one byte of memory
+     *   word ADDR      two bytes, high byte first
+     *   bcd ADDR N     N decimal digits, one per byte, high digit first, as FX33 writes them
+     *   reg X          register VX
+     */
+
+    enum value_kind { BYTE, WORD, BCD, REGISTER };
+
+    value_kind kind = BYTE;
+    unsigned int address = 0;   // or the register number
+    int digits = 0;
+
+    long long read(const chip8& game) const;
+};
+
+struct env_spec {
+    /*
+     * What a ROM's reward and end of episode are, loaded from a text file with one setting per line:
+     *   score <value>                  the reward of a step is how much this rose during it
+     *   done <value> <op> <number>     the episode ends when this holds, op is == != < <= > >=
+     *   frames_per_step <N>            frames each action is held for, 1 by default
+     *   max_frames <N>                 the episode also ends after this many frames, 0 for no limit
+     * Values are as in memory_value, numbers may be hex with 0x; several done lines end the episode
+     * when any holds; lines starting with # are comments
+     */
+
+    struct condition {
+        memory_value value;
+        enum { EQUAL, NOT_EQUAL, LESS, LESS_EQUAL, GREATER, GREATER_EQUAL } op = EQUAL;
+        long long number = 0;
+
+        bool holds(const chip8& game) const;
+    };
+
+    bool has_score = false;
+    memory_value score;
+    std::vector<condition> done;
+    int frames_per_step = 1;
+    unsigned long long max_frames = 0;
+
+    bool load(const char* path);
+};
+
+class vec_env {
+    /*
+     * A batch of copies of one ROM stepped together for reinforcement learning
+     * Actions are key masks, bit N holding key N for the whole step; observations are packed
+     * displays of 32 64-bit rows per environment (chip8::pack_display), written into the caller's
+     * buffer along with one reward and one done flag per environment
+     * An environment whose episode ends is reset at once, reseeded from its reset() seed, and its
+     * observation is the first frame of the new episode, as in the usual vectorized environments
+     * Environments are split into one contiguous slice per thread; the calling thread runs the
+     * first, and nothing is allocated after construction
+     */
+
+public:
+    static const int OBSERVATION_WORDS = 32;    // uint64_t per environment
+
+    vec_env(const chip8& prototype, const env_spec& spec, int count,
+            int threads = std::thread::hardware_concurrency());     // prototype has its ROM loaded
+    ~vec_env();
+
+    int size() const;
+    void reset(const uint64_t* seeds, uint64_t* observations);     // a seed per environment, 0 is a fixed seed rather than the clock
+    void step(const unsigned short* actions, uint64_t* observations, float* rewards, unsigned char* dones);
+
+    const chip8& game(int index) const;     // only between calls
+
+private:
+    struct env {
+        chip8 game;
+        uint64_t seed = 1;
+        unsigned long long episode = 0;
+        unsigned long long episode_frames = 0;
+        long long score = 0;
+    };
+
+    enum job_kind { RESET, STEP };
+
+    void restart(env& e);
+    void run_slice(int slice);
+    void work(int slice);
+    void run_job();
+
+    env_spec spec;
+    std::vector<env> envs;
+    std::vector<std::thread> workers;
+    int slices = 1;
+
+    // arguments of the current call, read by every slice
+    job_kind job = STEP;
+    const uint64_t* seeds = NULL;
+    const unsigned short* actions = NULL;
+    uint64_t* observations = NULL;
+    float* rewards = NULL;
+    unsigned char* dones = NULL;
+
+    // call handoff
+    std::mutex lock;
+    std::condition_variable started;
+    std::condition_variable finished;
+    unsigned long long generation = 0;     // incremented for each call, and on shutdown
+    bool stopping = false;
+    std::atomic<int> remaining{0};          // worker slices of this call not yet run
+};